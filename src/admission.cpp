@@ -0,0 +1,157 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "admission.h"
+
+Admission::Admission(int size, int sourceRate, int sourceBurst, int globalRate, int globalBurst)
+    : entries(size), hashHeads(size, -1)
+{
+    this->sourceRate = sourceRate;
+    this->sourceBurst = sourceBurst;
+    this->usedEntries = 0;
+    this->lruHead = -1;
+    this->lruTail = -1;
+
+    globalBucket.setRate(globalRate, globalBurst);
+    resetStats();
+}
+
+void Admission::resetStats()
+{
+    stats.admitted = 0;
+    stats.sourceLimited = 0;
+    stats.globalLimited = 0;
+    stats.evicted = 0;
+}
+
+int Admission::hash(uint32_t ip) const
+{
+    return (ip * 2654435761u) % hashHeads.size();
+}
+
+int Admission::find(uint32_t ip)
+{
+    for (int i = hashHeads[hash(ip)]; i != -1; i = entries[i].hashNext)
+        if (entries[i].ip == ip)
+            return i;
+
+    return -1;
+}
+
+void Admission::unlinkLru(int index)
+{
+    Entry &entry = entries[index];
+
+    if (entry.lruPrev != -1)
+        entries[entry.lruPrev].lruNext = entry.lruNext;
+    else
+        lruHead = entry.lruNext;
+
+    if (entry.lruNext != -1)
+        entries[entry.lruNext].lruPrev = entry.lruPrev;
+    else
+        lruTail = entry.lruPrev;
+}
+
+void Admission::pushLru(int index)
+{
+    Entry &entry = entries[index];
+
+    entry.lruPrev = -1;
+    entry.lruNext = lruHead;
+
+    if (lruHead != -1)
+        entries[lruHead].lruPrev = index;
+    else
+        lruTail = index;
+
+    lruHead = index;
+}
+
+void Admission::unlinkHash(int index)
+{
+    int *link = &hashHeads[hash(entries[index].ip)];
+
+    while (*link != index)
+        link = &entries[*link].hashNext;
+
+    *link = entries[index].hashNext;
+}
+
+int Admission::insert(uint32_t ip)
+{
+    int index;
+
+    if (usedEntries < entries.size())
+    {
+        index = usedEntries++;
+    }
+    else
+    {
+        index = lruTail;
+        unlinkLru(index);
+        unlinkHash(index);
+        stats.evicted++;
+    }
+
+    Entry &entry = entries[index];
+    entry.ip = ip;
+    entry.bucket = TokenBucket();
+    entry.bucket.setRate(sourceRate, sourceBurst);
+
+    int &head = hashHeads[hash(ip)];
+    entry.hashNext = head;
+    head = index;
+
+    pushLru(index);
+    return index;
+}
+
+bool Admission::admit(uint32_t ip, const Time &now)
+{
+    int index = find(ip);
+
+    if (index == -1)
+    {
+        index = insert(ip);
+    }
+    else
+    {
+        unlinkLru(index);
+        pushLru(index);
+    }
+
+    TokenBucket &bucket = entries[index].bucket;
+
+    if (!bucket.available(now))
+    {
+        stats.sourceLimited++;
+        return false;
+    }
+
+    if (!globalBucket.consume(now))
+    {
+        stats.globalLimited++;
+        return false;
+    }
+
+    bucket.consume(now);
+    stats.admitted++;
+    return true;
+}
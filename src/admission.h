@@ -0,0 +1,78 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "tokenbucket.h"
+
+#include <vector>
+#include <stdint.h>
+
+// rate limits packets from unknown sources, per source address and in total,
+// the least recently seen sources are forgotten when the table is full
+class Admission
+{
+public:
+    Admission(int size, int sourceRate, int sourceBurst, int globalRate, int globalBurst);
+
+    bool admit(uint32_t ip, const Time &now);
+
+    struct Stats
+    {
+        int admitted;
+        int sourceLimited;
+        int globalLimited;
+        int evicted;
+    };
+
+    const Stats &getStats() const { return stats; }
+    void resetStats();
+
+protected:
+    struct Entry
+    {
+        uint32_t ip;
+        int hashNext;
+        int lruPrev;
+        int lruNext;
+        TokenBucket bucket;
+    };
+
+    int find(uint32_t ip);
+    int insert(uint32_t ip);
+    void unlinkLru(int index);
+    void pushLru(int index);
+    void unlinkHash(int index);
+    int hash(uint32_t ip) const;
+
+    std::vector<Entry> entries;
+    std::vector<int> hashHeads;
+    int usedEntries;
+    int lruHead; // most recently seen
+    int lruTail;
+
+    int sourceRate;
+    int sourceBurst;
+    TokenBucket globalBucket;
+
+    Stats stats;
+};
+
+#endif
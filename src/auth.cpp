@@ -44,6 +44,61 @@ Auth::Response Auth::getResponse(const Challenge &challenge) const
     return response;
 }
 
+Auth::Challenge Auth::getSessionKey(const Challenge &challenge) const
+{
+    SHA1 hasher;
+
+    Response key;
+
+    hasher << passphrase.data();
+    hasher.Input(&challenge[0], challenge.size());
+    hasher << "session";
+
+    hasher.Result((unsigned int *)key.data);
+
+    for (int i = 0; i < 5; i++)
+        key.data[i] = htonl(key.data[i]);
+
+    return Challenge((char *)key.data, (char *)key.data + sizeof(key.data));
+}
+
+Auth::Response Auth::getMac(const Challenge &key, const char *data, int length)
+{
+    const int blockSize = 64;
+
+    char innerPad[blockSize];
+    char outerPad[blockSize];
+    memset(innerPad, 0x36, blockSize);
+    memset(outerPad, 0x5c, blockSize);
+
+    // keys are generated locally and never longer than a block
+    for (int i = 0; i < key.size() && i < blockSize; i++)
+    {
+        innerPad[i] ^= key[i];
+        outerPad[i] ^= key[i];
+    }
+
+    SHA1 hasher;
+    Response inner, response;
+
+    hasher.Input(innerPad, blockSize);
+    hasher.Input(data, length);
+    hasher.Result((unsigned int *)inner.data);
+
+    for (int i = 0; i < 5; i++)
+        inner.data[i] = htonl(inner.data[i]);
+
+    hasher.Reset();
+    hasher.Input(outerPad, blockSize);
+    hasher.Input((const char *)inner.data, sizeof(inner.data));
+    hasher.Result((unsigned int *)response.data);
+
+    for (int i = 0; i < 5; i++)
+        response.data[i] = htonl(response.data[i]);
+
+    return response;
+}
+
 Auth::Challenge Auth::generateChallenge(int length) const
 {
     Challenge challenge;
@@ -40,6 +40,9 @@ public:
 
     Challenge generateChallenge(int length) const;
     Response getResponse(const Challenge &challenge) const;
+    Challenge getSessionKey(const Challenge &challenge) const; // differs from the response
+
+    static Response getMac(const Challenge &key, const char *data, int length); // HMAC-SHA1
 
 protected:
     std::string passphrase;
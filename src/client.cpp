@@ -33,19 +33,81 @@ using std::string;
 
 const Worker::TunnelHeader::Magic Client::magic("hanc");
 
-Client::Client(int tunnelMtu, const string *deviceName, uint32_t serverIp,
+Client::Client(int tunnelMtu, const string *deviceName, const vector<uint32_t> &serverIps,
+               const vector<uint32_t> &pathIps, const vector<uint32_t> &sourceIps,
                int maxPolls, const string &passphrase, uid_t uid, gid_t gid,
-               bool changeEchoId, bool changeEchoSeq, uint32_t desiredIp)
-    : Worker(tunnelMtu, deviceName, false, uid, gid), auth(passphrase)
+               bool changeEchoId, bool changeEchoSeq, bool autoPolling, bool autoRotation,
+               int echoStreams, uint32_t desiredIp, int socketBufferSize)
+    : Worker(tunnelMtu, deviceName, false, uid, gid, socketBufferSize), auth(passphrase)
 {
-    this->serverIp = serverIp;
+    for (int i = 0; i < serverIps.size(); i++)
+        addServer(serverIps[i]);
+
+    while (this->echoStreams.size() < echoStreams)
+    {
+        EchoStream stream;
+        stream.id = Utility::rand();
+        stream.sequence = Utility::rand();
+
+        bool used = false;
+        for (int i = 0; i < this->echoStreams.size(); i++)
+            used |= this->echoStreams[i].id == stream.id;
+        if (!used)
+            this->echoStreams.push_back(stream);
+    }
+
+    this->pathIps = pathIps;
+    this->sourceIps = sourceIps;
+
+    // with one path, sequencing would only hold data back behind losses
+    if (pathIps.empty() && sourceIps.size() <= 1)
+        localCapabilities &= ~CAPABILITY_MULTIPATH;
+    this->currentServer = -1;
+    this->racing = false;
+    this->raceNext = 0;
+    this->redirects = 0;
+    this->sentSequence = 0;
+    this->sentRequestSequence = 0;
     this->clientIp = INADDR_NONE;
     this->desiredIp = desiredIp;
     this->maxPolls = maxPolls;
-    this->nextEchoId = Utility::rand();
+    this->configuredPolls = maxPolls;
+    this->keepAliveInterval = KEEP_ALIVE_INTERVAL;
     this->changeEchoId = changeEchoId;
     this->changeEchoSeq = changeEchoSeq;
-    this->nextEchoSequence = Utility::rand();
+    this->autoPolling = autoPolling;
+    this->autoRotation = autoRotation;
+    this->modeStep = MODE_STEP_NONE;
+    this->modeProbeTries = 0;
+    this->unansweredKeepAlives = 0;
+    this->idle = false;
+    this->idlePollWindow = 0;
+    this->bindingMeasured = false;
+    this->bindingLow = MODE_PROBE_DELAY;
+    this->bindingHigh = 0;
+    this->bindingProbe = 0;
+    this->nextEchoStream = 0;
+    this->capabilities = 0;
+    this->sessionId = 0;
+    this->handshakeRetries = 0;
+    this->pathMtu = maxEchoSize();
+    this->mtuProbeLow = 0;
+    this->mtuProbeHigh = 0;
+    this->mtuProbeSize = 0;
+    this->mtuProbeTries = 0;
+    this->pollWindow = maxPolls;
+    this->maxPollWindow = maxPolls;
+    this->serverPolls = 0;
+    this->rttValid = false;
+    this->rtt = 0;
+    this->minRtt = 0;
+    this->receivedPackets = 0;
+    this->deliveryRate = 0;
+    this->pacedPolls = 0;
+    this->pacerLimited = false;
+    this->sentRequests = 0;
+    this->receivedReplies = 0;
+    this->lossSampleValid = false;
 
     state = STATE_CLOSED;
 }
@@ -55,23 +117,293 @@ Client::~Client()
 
 }
 
+int Client::findServer(uint32_t realIp)
+{
+    for (int i = 0; i < servers.size(); i++)
+        if (servers[i].ip == realIp)
+            return i;
+
+    return -1;
+}
+
+int Client::addServer(uint32_t ip)
+{
+    Candidate server;
+    server.ip = ip;
+    server.legacy = false;
+    server.rtt = -1;
+    server.refused = false;
+    server.down = false;
+    server.redirect = -1;
+    server.attempt = STATE_CLOSED;
+    server.attempts = 0;
+    servers.push_back(server);
+
+    return servers.size() - 1;
+}
+
+int Client::raceRank(const Candidate &server)
+{
+    // servers we were sent to go first, then those that answered quickly
+    // before and those that stopped answering last
+    if (server.redirect >= 0)
+        return 0;
+    if (server.down)
+        return 3;
+    return server.rtt < 0 ? 2 : 1;
+}
+
+void Client::selectServer(int index)
+{
+    if (index == currentServer)
+        return;
+
+    currentServer = index;
+
+    // every server address is used from every source address, the
+    // server's own address comes first. the addresses given with -P are
+    // those of the one server given with -c, not of those we are sent to.
+    vector<uint32_t> serverIps(1, servers[index].ip);
+    if (index == 0)
+        serverIps.insert(serverIps.end(), pathIps.begin(), pathIps.end());
+
+    paths.clear();
+    for (int i = 0; i < serverIps.size(); i++)
+    {
+        for (int j = 0; j < (sourceIps.empty() ? 1 : sourceIps.size()); j++)
+        {
+            Path path;
+            path.serverIp = serverIps[i];
+            path.localIp = sourceIps.empty() ? 0 : sourceIps[j];
+            path.rttValid = false;
+            path.rtt = 0;
+            path.loss = 0;
+            path.sentRequests = 0;
+            path.receivedReplies = 0;
+            path.lossSampleValid = false;
+            path.confirmed = false;
+            path.counted = false;
+            path.credit = 0;
+            paths.push_back(path);
+        }
+    }
+
+    // measured to the previous server
+    rttValid = false;
+}
+
+void Client::connect()
+{
+    raceOrder.clear();
+    for (int i = 0; i < servers.size(); i++)
+    {
+        servers[i].attempt = STATE_CLOSED;
+        if (servers[i].refused)
+            continue;
+
+        int rank = raceRank(servers[i]);
+        vector<int>::iterator it = raceOrder.begin();
+        while (it != raceOrder.end())
+        {
+            const Candidate &other = servers[*it];
+            int otherRank = raceRank(other);
+            if (rank < otherRank ||
+                (rank == otherRank && rank == 0 && servers[i].redirect < other.redirect) ||
+                (rank == otherRank && rank == 1 && servers[i].rtt < other.rtt))
+                break;
+            ++it;
+        }
+        raceOrder.insert(it, i);
+    }
+
+    if (raceOrder.empty())
+        throw Exception("server full");
+
+    // shared by all servers raced, any of them may redirect us
+    redirectNonce = auth.generateChallenge(REDIRECT_NONCE_SIZE);
+
+    raceNext = 0;
+    racing = raceOrder.size() > 1;
+    sendNextAttempt();
+}
+
+void Client::forgetRefusals()
+{
+    // a server that was full may have room again by the next time we need one
+    for (int i = 0; i < servers.size(); i++)
+        servers[i].refused = false;
+}
+
+void Client::sendNextAttempt()
+{
+    // like happy eyeballs, the next server gets its handshake if the ones
+    // before have not answered within SERVER_ATTEMPT_DELAY
+    selectServer(raceOrder[raceNext++]);
+    sendConnectionRequest();
+
+    Candidate &server = servers[currentServer];
+    server.attempt = state;
+    server.attempts++;
+    server.attemptSent = now;
+
+    if (racing && raceNext < raceOrder.size())
+        setStateTimeout(SERVER_ATTEMPT_DELAY);
+    else
+        setHandshakeTimeout();
+}
+
+void Client::finishRace(int server)
+{
+    racing = false;
+    selectServer(server);
+
+    // continue the handshake this server answered
+    state = servers[server].attempt;
+    handshakeSent = servers[server].attemptSent;
+    handshakeRetries = servers[server].attempts;
+    if (state == STATE_RESUME_SENT)
+        sessionKey = auth.getSessionKey(servers[server].ticket);
+
+    // the others may have accepted our resume already, which spends the
+    // ticket there. a full handshake beats a resume that gets rejected.
+    for (int i = 0; i < servers.size(); i++)
+    {
+        if (i != server && servers[i].attempt == STATE_RESUME_SENT)
+            servers[i].ticket.clear();
+        servers[i].attempts = 0;
+    }
+
+    syslog(LOG_DEBUG, "server %s answered first", Utility::formatIp(servers[server].ip).data());
+}
+
+bool Client::handleRedirect(int dataLength)
+{
+    // anyone could send us elsewhere, so only lists authenticated with the
+    // nonce of our connection request are followed
+    const uint32_t *addresses = (const uint32_t *)echoReceivePayloadBuffer();
+    int length = dataLength - sizeof(Auth::Response);
+    int count = length / (int)sizeof(uint32_t);
+    if (count <= 0 || length % sizeof(uint32_t) != 0)
+        return false;
+
+    Auth::Response mac = Auth::getMac(auth.getSessionKey(redirectNonce), (const char *)addresses, length);
+    if (memcmp(&mac, echoReceivePayloadBuffer() + length, sizeof(Auth::Response)) != 0)
+    {
+        syslog(LOG_DEBUG, "ignoring unauthenticated redirect");
+        return false;
+    }
+
+    servers[currentServer].refused = true;
+    syslog(LOG_INFO, "redirected from %s to %s", Utility::formatIp(servers[currentServer].ip).data(),
+           Utility::formatIp(ntohl(addresses[0])).data());
+
+    for (int i = 0; i < servers.size(); i++)
+        servers[i].redirect = -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        int server = findServer(ntohl(addresses[i]));
+        if (server == -1 && servers.size() < MAX_SERVERS)
+            server = addServer(ntohl(addresses[i]));
+        if (server != -1 && servers[server].redirect == -1)
+            servers[server].redirect = i;
+    }
+
+    redirects++;
+    connect();
+    return true;
+}
+
 void Client::sendConnectionRequest()
 {
+    const Candidate &server = servers[currentServer];
+    resetMode();
+
+    if (!server.ticket.empty())
+    {
+        sendResume();
+        return;
+    }
+
     Server::ClientConnectData *connectData = (Server::ClientConnectData *)echoSendPayloadBuffer();
-    connectData->maxPolls = maxPolls;
+    connectData->maxPolls = maxPolls < 255 ? maxPolls : 255;
     connectData->desiredIp = desiredIp;
 
+    int length = sizeof(Server::ClientConnectData);
+    if (!server.legacy)
+    {
+        writeProtocolInfo(echoSendPayloadBuffer() + length, maxPolls != 0 ? MAX_POLL_WINDOW : 0, redirects);
+        length += sizeof(ProtocolInfo);
+
+        memcpy(echoSendPayloadBuffer() + length, &redirectNonce[0], REDIRECT_NONCE_SIZE);
+        length += REDIRECT_NONCE_SIZE;
+    }
+
     syslog(LOG_DEBUG, "sending connection request");
 
-    sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, sizeof(Server::ClientConnectData));
+    capabilities = 0;
+    sessionId = 0;
+    mtuProbeSize = 0;
+    mtuReprobe = Time::ZERO;
+    sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, length);
 
     state = STATE_CONNECTION_REQUEST_SENT;
-    setTimeout(5000);
 }
 
-void Client::sendChallengeResponse(int dataLength)
+void Client::sendResume()
+{
+    resetMode();
+    syslog(LOG_DEBUG, "sending resumption ticket");
+
+    const vector<char> &ticket = servers[currentServer].ticket;
+    char *payload = echoSendPayloadBuffer();
+    memcpy(payload, &ticket[0], ticket.size());
+    *(uint32_t *)(payload + ticket.size()) = htonl(now.getMilliseconds());
+
+    sessionKey = auth.getSessionKey(ticket);
+    Auth::Response proof = Auth::getMac(sessionKey, payload, ticket.size() + sizeof(uint32_t));
+    memcpy(payload + ticket.size() + sizeof(uint32_t), &proof, sizeof(Auth::Response));
+
+    capabilities = 0;
+    sessionId = 0;
+    mtuProbeSize = 0;
+    mtuReprobe = Time::ZERO;
+    sendEchoToServer(TunnelHeader::TYPE_RESUME, Server::RESUME_SIZE);
+
+    state = STATE_RESUME_SENT;
+}
+
+void Client::setHandshakeTimeout()
+{
+    // starts out from the round trip time of the last connection and backs
+    // off exponentially while the server does not answer
+    int timeout = rttValid ? 2 * rtt : HANDSHAKE_INITIAL_TIMEOUT;
+    if (timeout < HANDSHAKE_MIN_TIMEOUT)
+        timeout = HANDSHAKE_MIN_TIMEOUT;
+
+    for (int i = 0; i < handshakeRetries && timeout < HANDSHAKE_MAX_TIMEOUT; i++)
+        timeout *= 2;
+    if (timeout > HANDSHAKE_MAX_TIMEOUT)
+        timeout = HANDSHAKE_MAX_TIMEOUT;
+
+    handshakeRetries++;
+    handshakeSent = now;
+    setStateTimeout(timeout);
+}
+
+void Client::handshakeReplyReceived()
+{
+    // only replies to a packet that was not retransmitted tell the round
+    // trip time
+    if (handshakeRetries == 1)
+        updateRtt((receivedTime - handshakeSent).getMilliseconds());
+
+    handshakeRetries = 0;
+}
+
+void Client::sendChallengeResponse(int dataLength, bool cookie)
 {
-    if (dataLength != CHALLENGE_SIZE)
+    if (cookie ? dataLength > payloadBufferSize() - sizeof(Auth::Response) : dataLength != CHALLENGE_SIZE)
         throw Exception("invalid challenge received");
 
     state = STATE_CHALLENGE_RESPONSE_SENT;
@@ -85,32 +417,124 @@ void Client::sendChallengeResponse(int dataLength)
     Auth::Response response = auth.getResponse(challenge);
 
     memcpy(echoSendPayloadBuffer(), (char *)&response, sizeof(Auth::Response));
-    sendEchoToServer(TunnelHeader::TYPE_CHALLENGE_RESPONSE, sizeof(Auth::Response));
 
-    setTimeout(5000);
+    // the server keeps no state until it sees its cookie again
+    int length = sizeof(Auth::Response);
+    if (cookie)
+    {
+        sessionKey = auth.getSessionKey(challenge);
+
+        memcpy(echoSendPayloadBuffer() + length, &challenge[0], dataLength);
+        length += dataLength;
+    }
+
+    sendEchoToServer(TunnelHeader::TYPE_CHALLENGE_RESPONSE, length);
+
+    setHandshakeTimeout();
 }
 
 bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t realIp, bool reply, uint16_t, uint16_t)
 {
-    if (realIp != serverIp || !reply)
+    if (!reply || header.magic != Server::magic)
         return false;
 
-    if (header.magic != Server::magic)
+    // the first server to answer wins the race
+    if (racing)
+    {
+        int server = findServer(realIp);
+        if (server == -1 || servers[server].attempt == STATE_CLOSED)
+            return false;
+        finishRace(server);
+    }
+
+    int path = findPath(realIp, receivedLocalIp);
+    if (path == -1)
         return false;
 
+    lastServerReply = now;
+    unansweredKeepAlives = 0;
+
+    // the timer only fires when a refresh goes missing
+    if (idle && maxPolls != 0)
+        setStateTimeout(bindingLow * 3 / 2);
+    receivedReplies++;
+    paths[path].receivedReplies++;
+    paths[path].lastReply = now;
+    paths[path].confirmed = true;
+
+    uint32_t timestamp;
+    if (receivedOptions.get(TunnelHeader::FLAG_TIMESTAMP, timestamp))
+    {
+        int sample = receivedTime.getMilliseconds() - timestamp;
+        updateRtt(sample);
+
+        // replies come back the way their request went
+        Path &replyPath = paths[path];
+        if (sample >= 0 && sample <= KEEP_ALIVE_INTERVAL)
+        {
+            replyPath.rtt = replyPath.rttValid ? replyPath.rtt + (sample - replyPath.rtt) / 8 : sample;
+            replyPath.rttValid = true;
+        }
+    }
+
+    uint32_t status;
+    if (receivedOptions.get(TunnelHeader::FLAG_POLL_STATUS, status))
+        serverPolls = status & 0xffff;
+
+    uint32_t counters;
+    if (receivedOptions.get(TunnelHeader::FLAG_COUNTERS, counters))
+        updatePacingRate(counters);
+    if (receivedOptions.get(TunnelHeader::FLAG_PATH_COUNTERS, counters))
+        updatePathLoss(paths[path], counters);
+
+    if (state != STATE_ESTABLISHED && state != STATE_CLOSED)
+        handshakeReplyReceived();
+
     switch (header.type)
     {
         case TunnelHeader::TYPE_RESET_CONNECTION:
             syslog(LOG_DEBUG, "reset received");
 
+            // the server does not know the ticket, it might have restarted
+            if (state == STATE_RESUME_SENT)
+                servers[currentServer].ticket.clear();
+
+            // servers before protocol version 2 reject our request with an
+            // empty reset
+            if (dataLength < sizeof(ProtocolInfo))
+            {
+                if (state == STATE_CONNECTION_REQUEST_SENT && !servers[currentServer].legacy)
+                {
+                    syslog(LOG_DEBUG, "server uses an older protocol version");
+                    servers[currentServer].legacy = true;
+                }
+            }
+            else
+            {
+                servers[currentServer].legacy = false;
+            }
+
             sendConnectionRequest();
+            setHandshakeTimeout();
             return true;
         case TunnelHeader::TYPE_SERVER_FULL:
             if (state == STATE_CONNECTION_REQUEST_SENT)
             {
-                throw Exception("server full");
+                if (servers.size() == 1)
+                    throw Exception("server full");
+
+                // the others are asked again
+                syslog(LOG_WARNING, "server %s is full",
+                       Utility::formatIp(servers[currentServer].ip).data());
+                servers[currentServer].refused = true;
+                connect();
+                return true;
             }
             break;
+        case TunnelHeader::TYPE_REDIRECT:
+            if (state == STATE_CONNECTION_REQUEST_SENT && handleRedirect(dataLength))
+                return true;
+            break;
         case TunnelHeader::TYPE_CHALLENGE:
             if (state == STATE_CONNECTION_REQUEST_SENT)
             {
@@ -119,31 +543,112 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
                 return true;
             }
             break;
+        case TunnelHeader::TYPE_CHALLENGE_COOKIE:
+            if (state == STATE_CONNECTION_REQUEST_SENT)
+            {
+                syslog(LOG_DEBUG, "authentication request received");
+                sendChallengeResponse(dataLength, true);
+                return true;
+            }
+            break;
         case TunnelHeader::TYPE_CONNECTION_ACCEPT:
-            if (state == STATE_CHALLENGE_RESPONSE_SENT)
+            if (state == STATE_CHALLENGE_RESPONSE_SENT || state == STATE_RESUME_SENT)
             {
-                if (dataLength != sizeof(uint32_t))
+                ProtocolInfo info;
+                info.version = 1;
+                info.maxPolls = maxPolls < 255 ? maxPolls : 255;
+                info.capabilities = 0;
+
+                if (dataLength != sizeof(uint32_t) &&
+                    !readProtocolInfo(echoReceivePayloadBuffer() + sizeof(uint32_t),
+                                      dataLength - sizeof(uint32_t), info))
                 {
                     throw Exception("invalid ip received");
                     return true;
                 }
 
+                capabilities = info.capabilities & localCapabilities;
+                maxPollWindow = info.maxPolls;
+
+                // lets the server tell us apart from other clients behind
+                // the same address
+                int sessionOffset = sizeof(uint32_t) + sizeof(ProtocolInfo);
+                sessionId = 0;
+                if (dataLength >= sessionOffset + sizeof(uint32_t))
+                    sessionId = ntohl(*(uint32_t *)(echoReceivePayloadBuffer() + sessionOffset));
+
+                sentSequence = 0;
+                sentRequestSequence = 0;
+                reorder.reset();
+                for (int i = 0; i < paths.size(); i++)
+                {
+                    paths[i].lossSampleValid = false;
+                    paths[i].lastReply = now;
+                    paths[i].confirmed = i == 0;
+                    paths[i].counted = i == 0;
+                }
+
+                // presented instead of the handshake when we reconnect
+                Candidate &server = servers[currentServer];
+                int ticketOffset = sessionOffset + sizeof(uint32_t);
+                server.ticket.clear();
+                if (dataLength == ticketOffset + Server::TICKET_SIZE)
+                    server.ticket.assign(echoReceivePayloadBuffer() + ticketOffset,
+                                         echoReceivePayloadBuffer() + dataLength);
+                server.rtt = rttValid ? rtt : -1;
+                server.down = false;
+                pollWindow = maxPolls < maxPollWindow ? maxPolls : maxPollWindow;
+
+                redirects = 0;
+                for (int i = 0; i < servers.size(); i++)
+                    servers[i].redirect = -1;
+
                 syslog(LOG_INFO, "connection established");
+                if (servers.size() > 1)
+                    syslog(LOG_INFO, "using server %s", Utility::formatIp(server.ip).data());
+                syslog(LOG_DEBUG, "server protocol version %d, capabilities 0x%x, max polls %d",
+                       info.version, capabilities, maxPollWindow);
 
                 uint32_t ip = ntohl(*(uint32_t *)echoReceivePayloadBuffer());
                 if (ip != clientIp)
                 {
                     if (privilegesDropped)
-                        throw Exception("could not get the same ip address, so root privileges are required to change it");
+                    {
+                        // servers using another network are skipped, as
+                        // long as there are others to fail over to
+                        servers[currentServer].refused = true;
+                        bool others = false;
+                        for (int i = 0; i < servers.size(); i++)
+                            others = others || !servers[i].refused;
+                        if (!others)
+                            throw Exception("could not get the same ip address, so root privileges are required to change it");
+
+                        syslog(LOG_WARNING, "server %s assigned another ip address, trying the others",
+                               Utility::formatIp(server.ip).data());
+                        connect();
+                        return true;
+                    }
 
                     clientIp = ip;
                     desiredIp = ip;
                     tun.setIp(ip, (ip & 0xffffff00) + 1);
                 }
                 state = STATE_ESTABLISHED;
+                lastTraffic = now;
+                forgetRefusals();
+
+                if (pathCount() > 1)
+                    syslog(LOG_INFO, "using %d paths", pathCount());
 
-                dropPrivileges();
                 startPolling();
+                releaseHeldPackets();
+
+                // changing the tunnel mtu needs root privileges, they are
+                // dropped once the first discovery is done
+                if (!startMtuDiscovery())
+                    dropPrivileges();
+
+                startModeDiscovery();
 
                 return true;
             }
@@ -161,6 +666,34 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
                 return true;
             }
             break;
+        case TunnelHeader::TYPE_POLL:
+            if (state == STATE_ESTABLISHED)
+            {
+                handlePollRefresh();
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_MTU_PROBE:
+            if (state == STATE_ESTABLISHED)
+            {
+                handleMtuProbe(dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_MODE_PROBE:
+            if (state == STATE_ESTABLISHED)
+            {
+                handleModeProbe(dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_PATH_CHALLENGE:
+            if (state == STATE_ESTABLISHED)
+            {
+                handlePathChallenge(path, dataLength);
+                return true;
+            }
+            break;
         default:
             break;
     }
@@ -170,78 +703,1146 @@ bool Client::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
     return true;
 }
 
-void Client::sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength)
+void Client::sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength, EchoStream *echoId,
+                              int pathIndex)
 {
-    if (maxPolls == 0 && state == STATE_ESTABLISHED)
-        setTimeout(KEEP_ALIVE_INTERVAL);
+    // keep alives that are answered go out regularly, they tell whether
+    // the server is still there
+    if (maxPolls == 0 && !autoPolling && state == STATE_ESTABLISHED)
+        setStateTimeout(keepAliveInterval);
+
+    if (type == TunnelHeader::TYPE_POLL && idle && (capabilities & CAPABILITY_IDLE_POLLS))
+    {
+        *(uint32_t *)echoSendPayloadBuffer() = htonl(bindingLow);
+        dataLength = sizeof(uint32_t);
+    }
+
+    HeaderOptions options;
+
+    if (capabilities & CAPABILITY_ADAPTIVE_POLLING)
+    {
+        options.set(TunnelHeader::FLAG_TIMESTAMP, now.getMilliseconds());
+
+        if (type == TunnelHeader::TYPE_POLL)
+        {
+            options.set(TunnelHeader::FLAG_POLL_WINDOW, pollWindow);
+            recentPolls.push_back(now);
+        }
+    }
+
+    // handshakes and probes stay on the first path, the server only knows
+    // the other addresses once the session is up
+    Path *path = &paths[pathIndex != -1 ? pathIndex : 0];
+    if (pathIndex == -1 && pathCount() > 1 &&
+        (type == TunnelHeader::TYPE_DATA || type == TunnelHeader::TYPE_POLL))
+        path = &paths[selectPath(type == TunnelHeader::TYPE_POLL)];
+
+    // the server drops what it has seen from the other paths before
+    uint32_t sequence = 0;
+    if (sessionId != 0 && pathCount() > 1)
+    {
+        sequence = type == TunnelHeader::TYPE_DATA ? sentSequence++ : sentRequestSequence++;
+        options.set(TunnelHeader::FLAG_SEQUENCE, sequence);
+    }
+
+    if (sessionId != 0 && (capabilities & CAPABILITY_EXTENDED_HEADER))
+    {
+        options.set(TunnelHeader::FLAG_SESSION, sessionId);
 
-    sendEcho(magic, type, dataLength, serverIp, false, nextEchoId, nextEchoSequence);
+        // lets the server follow us when our address changes
+        uint32_t timestamp;
+        if (options.get(TunnelHeader::FLAG_TIMESTAMP, timestamp))
+            options.set(TunnelHeader::FLAG_SESSION_AUTH, getSessionAuth(sessionKey, sessionId, timestamp, sequence,
+                                                                        type, echoSendPayloadBuffer(), dataLength));
+    }
+
+    // mode probes bring their own id
+    EchoStream *stream = echoId;
+    if (stream == NULL)
+    {
+        stream = &echoStreams[nextEchoStream];
+        nextEchoStream = (nextEchoStream + 1) % echoStreams.size();
+    }
+
+    sendEcho(magic, type, dataLength, path->serverIp, path->localIp, false, stream->id, stream->sequence,
+             capabilities & CAPABILITY_EXTENDED_HEADER, options);
+    path->lastRequest = now;
+
+    // until the server took up the path it does not count what arrives
+    if (path->counted)
+    {
+        sentRequests++;
+        path->sentRequests++;
+    }
+
+    if (echoId != NULL)
+        return;
 
     if (changeEchoId)
-        nextEchoId = nextEchoId + 38543; // some random prime
+        stream->id = stream->id + 38543; // some random prime
     if (changeEchoSeq)
-        nextEchoSequence = nextEchoSequence + 38543; // some random prime
+        stream->sequence = stream->sequence + 38543; // some random prime
 }
 
-void Client::startPolling()
+bool Client::startMtuDiscovery()
 {
-    if (maxPolls == 0)
-    {
-        setTimeout(KEEP_ALIVE_INTERVAL);
-    }
-    else
+    if ((capabilities & CAPABILITY_PATH_MTU) == 0 || maxEchoSize() <= PMTU_MIN_SIZE)
+        return false;
+
+    mtuProbeLow = PMTU_MIN_SIZE;
+    mtuProbeHigh = maxEchoSize();
+
+    // the configured size fits most paths, so it is tried first
+    mtuProbeSize = mtuProbeHigh;
+    mtuProbeTries = 0;
+    sendMtuProbe();
+
+    return mtuProbeSize != 0;
+}
+
+void Client::sendMtuProbe()
+{
+    int length = mtuProbeLength(mtuProbeSize);
+
+    MtuProbe *probe = (MtuProbe *)echoSendPayloadBuffer();
+    probe->size = htons(mtuProbeSize);
+    probe->kind = MtuProbe::KIND_REQUEST;
+    probe->reserved = 0;
+    memset(probe + 1, 0, length - sizeof(MtuProbe));
+
+    // fragments would get through where the whole packet does not
+    if (!echo.setDontFragment(true))
     {
-        for (int i = 0; i < maxPolls; i++)
-            sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
-        setTimeout(POLL_INTERVAL);
+        mtuProbeSize = 0;
+        return;
     }
+
+    sendEchoToServer(TunnelHeader::TYPE_MTU_PROBE, length);
+    echo.setDontFragment(false);
+
+    int timeout = rttValid ? 2 * rtt : PMTU_PROBE_TIMEOUT;
+    if (timeout < PMTU_MIN_TIMEOUT)
+        timeout = PMTU_MIN_TIMEOUT;
+
+    mtuProbeTries++;
+    mtuProbeTimeout = now + timeout;
+    updateTimeout();
 }
 
-void Client::handleDataFromServer(int dataLength)
+void Client::nextMtuProbe()
 {
-    if (dataLength == 0)
+    if (mtuProbeHigh - mtuProbeLow < PMTU_PRECISION)
     {
-        syslog(LOG_WARNING, "received empty data packet");
+        finishMtuDiscovery();
         return;
     }
 
-    sendToTun(dataLength);
-
-    if (maxPolls != 0)
-        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+    mtuProbeSize = (mtuProbeLow + mtuProbeHigh + 1) / 2;
+    mtuProbeTries = 0;
+    sendMtuProbe();
 }
 
-void Client::handleTunData(int dataLength, uint32_t, uint32_t)
+void Client::handleMtuProbe(int dataLength)
 {
-    if (state != STATE_ESTABLISHED)
+    if (dataLength < sizeof(MtuProbe))
+        return;
+
+    const MtuProbe *probe = (const MtuProbe *)echoReceivePayloadBuffer();
+    int size = ntohs(probe->size);
+
+    if (probe->kind != MtuProbe::KIND_REPLY || mtuProbeSize == 0)
+        return;
+
+    // late replies to earlier probes still tell a size that got through
+    if (size <= mtuProbeLow || size > mtuProbeHigh)
         return;
 
-    sendEchoToServer(TunnelHeader::TYPE_DATA, dataLength);
+    mtuProbeLow = size;
+    if (size >= mtuProbeSize)
+        nextMtuProbe();
 }
 
-void Client::handleTimeout()
+void Client::finishMtuDiscovery()
 {
-    switch (state)
+    mtuProbeSize = 0;
+
+    // the tunnel mtu can only be changed as root, so the path is only probed
+    // again if we keep the privileges. they are needed for setting the mtu
+    // itself, so there is no descriptor to hold on to instead.
+    mtuReprobe = uid <= 0 ? now + PMTU_REPROBE_INTERVAL : Time::ZERO;
+
+    MtuProbe *result = (MtuProbe *)echoSendPayloadBuffer();
+    result->size = htons(mtuProbeLow);
+    result->kind = MtuProbe::KIND_RESULT;
+    result->reserved = 0;
+    sendEchoToServer(TunnelHeader::TYPE_MTU_PROBE, sizeof(MtuProbe));
+
+    if (mtuProbeLow != pathMtu)
     {
-        case STATE_CONNECTION_REQUEST_SENT:
-        case STATE_CHALLENGE_RESPONSE_SENT:
-            sendConnectionRequest();
-            break;
+        syslog(LOG_INFO, "path mtu is %d bytes", mtuProbeLow);
 
-        case STATE_ESTABLISHED:
-            sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
-            setTimeout(maxPolls == 0 ? KEEP_ALIVE_INTERVAL : POLL_INTERVAL);
-            break;
-        case STATE_CLOSED:
-            break;
+        if (privilegesDropped)
+        {
+            syslog(LOG_WARNING, "root privileges are required to change the tunnel mtu");
+        }
+        else
+        {
+            pathMtu = mtuProbeLow;
+            tun.setMtu(pathMtu - headerSize() - Echo::headerSize());
+        }
     }
+
+    dropPrivileges();
 }
 
-void Client::run()
+void Client::startModeDiscovery()
 {
-    now = Time::now();
+    if ((capabilities & CAPABILITY_MODE_PROBE) == 0)
+        return;
 
-    sendConnectionRequest();
+    if (autoRotation)
+        modeStep = MODE_STEP_REUSE;
+    else if (autoPolling && maxPollWindow != 0)
+        modeStep = MODE_STEP_REPLIES;
+    else
+        return;
+
+    modeProbeTries = 0;
+    sendModeProbe();
+}
+
+void Client::sendModeProbe()
+{
+    // every try has an id and token of its own, late replies to an earlier
+    // one do not count
+    modeProbeId.id = Utility::rand();
+    modeProbeId.sequence = Utility::rand();
+    modeProbeToken = Utility::rand();
+    modeProbeReplies = 0;
+    modeProbeDelayed = false;
+
+    ModeProbe *probe = (ModeProbe *)echoSendPayloadBuffer();
+    probe->kind = ModeProbe::KIND_REQUEST;
+    probe->token = htonl(modeProbeToken);
+
+    int timeout = rttValid ? 2 * rtt : MODE_PROBE_TIMEOUT;
+    if (timeout < MODE_MIN_TIMEOUT)
+        timeout = MODE_MIN_TIMEOUT;
+
+    if (modeStep == MODE_STEP_REPLIES || modeStep == MODE_STEP_BINDING)
+    {
+        int delay = modeStep == MODE_STEP_BINDING ? bindingProbe : MODE_PROBE_DELAY;
+        probe->replies = modeStep == MODE_STEP_BINDING ? 0 : MODE_PROBE_REPLIES;
+        probe->delay = htons(delay);
+        sendEchoToServer(TunnelHeader::TYPE_MODE_PROBE, sizeof(ModeProbe), &modeProbeId);
+        timeout += delay;
+    }
+    else
+    {
+        // the second request repeats the id, and in the first step the
+        // sequence number as well
+        probe->replies = 1;
+        probe->delay = 0;
+        sendEchoToServer(TunnelHeader::TYPE_MODE_PROBE, sizeof(ModeProbe), &modeProbeId);
+        if (modeStep == MODE_STEP_SEQUENCE)
+            modeProbeId.sequence++;
+        sendEchoToServer(TunnelHeader::TYPE_MODE_PROBE, sizeof(ModeProbe), &modeProbeId);
+    }
+
+    modeProbeTries++;
+    modeProbeTimeout = now + timeout;
+    updateTimeout();
+}
+
+void Client::handleModeProbe(int dataLength)
+{
+    if (dataLength < sizeof(ModeProbe) || modeStep == MODE_STEP_NONE)
+        return;
+
+    const ModeProbe *probe = (const ModeProbe *)echoReceivePayloadBuffer();
+    if (probe->kind != ModeProbe::KIND_REPLY || ntohl(probe->token) != modeProbeToken)
+        return;
+
+    // the late reply has the highest index
+    if (probe->replies >= (modeStep == MODE_STEP_REPLIES ? MODE_PROBE_REPLIES : modeStep == MODE_STEP_BINDING ? 0 : 1))
+        modeProbeDelayed = true;
+    else
+        modeProbeReplies++;
+
+    if (modeStepPassed())
+        finishModeStep();
+}
+
+bool Client::modeStepPassed()
+{
+    switch (modeStep)
+    {
+        case MODE_STEP_REUSE:
+        case MODE_STEP_SEQUENCE:
+            return modeProbeReplies >= 2;
+        case MODE_STEP_REPLIES:
+            return modeProbeReplies >= MODE_PROBE_REPLIES && modeProbeDelayed;
+        case MODE_STEP_BINDING:
+            return modeProbeDelayed;
+        case MODE_STEP_NONE:
+            break;
+    }
+
+    return false;
+}
+
+void Client::finishModeStep()
+{
+    bool passed = modeStepPassed();
+
+    // a single lost reply is not taken for a middlebox dropping them
+    if (!passed && modeProbeTries < MODE_PROBE_TRIES)
+    {
+        sendModeProbe();
+        return;
+    }
+
+    // no reply is the answer here
+    if (modeStep == MODE_STEP_BINDING)
+    {
+        finishBindingStep(passed);
+        return;
+    }
+
+    // nothing came back at all, which tells nothing about the path. polling
+    // keeps the tunnel working and notices a server that is gone
+    if (modeProbeReplies == 0 && !modeProbeDelayed)
+    {
+        syslog(LOG_DEBUG, "mode probes unanswered");
+        if (autoPolling)
+            setPolling(true);
+
+        modeStep = MODE_STEP_NONE;
+        modeReprobe = now + MODE_REPROBE_INTERVAL;
+        return;
+    }
+
+    bool oldChangeEchoId = changeEchoId;
+    bool oldChangeEchoSeq = changeEchoSeq;
+
+    switch (modeStep)
+    {
+        case MODE_STEP_REUSE:
+            if (!passed)
+            {
+                modeStep = MODE_STEP_SEQUENCE;
+                modeProbeTries = 0;
+                sendModeProbe();
+                return;
+            }
+
+            changeEchoId = false;
+            changeEchoSeq = false;
+            break;
+        case MODE_STEP_SEQUENCE:
+            // a new sequence number gets through where the same one does
+            // not, a new id is the last resort
+            changeEchoId = !passed;
+            changeEchoSeq = passed;
+            break;
+        case MODE_STEP_REPLIES:
+            setPolling(!passed);
+
+            modeStep = MODE_STEP_NONE;
+            modeReprobe = now + MODE_REPROBE_INTERVAL;
+            return;
+        case MODE_STEP_NONE:
+        case MODE_STEP_BINDING:
+            return;
+    }
+
+    if (changeEchoId != oldChangeEchoId || changeEchoSeq != oldChangeEchoSeq)
+        syslog(LOG_INFO, "%s", changeEchoId ? "changing the echo id on every request" :
+                               changeEchoSeq ? "changing the echo sequence number on every request" :
+                               "keeping the echo id and sequence number");
+
+    if (autoPolling && maxPollWindow != 0)
+    {
+        modeStep = MODE_STEP_REPLIES;
+        modeProbeTries = 0;
+        sendModeProbe();
+    }
+    else
+    {
+        modeStep = MODE_STEP_NONE;
+        modeReprobe = now + MODE_REPROBE_INTERVAL;
+    }
+}
+
+void Client::setPolling(bool enable)
+{
+    if (enable == (maxPolls != 0))
+        return;
+
+    // idle mode starts over in the new one
+    idle = false;
+    lastTraffic = now;
+
+    if (enable)
+    {
+        syslog(LOG_INFO, "replies need polling");
+
+        maxPolls = configuredPolls;
+        keepAliveInterval = KEEP_ALIVE_INTERVAL;
+        pollWindow = maxPolls < maxPollWindow ? maxPolls : maxPollWindow;
+        startPolling();
+    }
+    else
+    {
+        syslog(LOG_INFO, "replies get through without polling");
+
+        // the poll tells the server, the keep alives hold the mapping of
+        // middleboxes open at least as long as the probe showed
+        maxPolls = 0;
+        pollWindow = 0;
+        keepAliveInterval = MODE_PROBE_DELAY;
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        setStateTimeout(keepAliveInterval);
+    }
+}
+
+void Client::resetMode()
+{
+    modeStep = MODE_STEP_NONE;
+    modeReprobe = Time::ZERO;
+    unansweredKeepAlives = 0;
+    idle = false;
+    bindingMeasured = false;
+    bindingLow = MODE_PROBE_DELAY;
+    bindingHigh = 0;
+
+    if (autoPolling)
+    {
+        maxPolls = configuredPolls;
+        keepAliveInterval = KEEP_ALIVE_INTERVAL;
+    }
+}
+
+void Client::enterIdle()
+{
+    idle = true;
+    syslog(LOG_DEBUG, "idle, keep alive every %d ms", bindingLow);
+
+    if (maxPolls != 0)
+    {
+        // one poll is enough for the first packet, the others are let go
+        idlePollWindow = pollWindow;
+        pollWindow = 1;
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        setStateTimeout(bindingLow * 3 / 2);
+    }
+    else
+    {
+        keepAliveInterval = bindingLow;
+        setStateTimeout(keepAliveInterval);
+    }
+
+    startBindingDiscovery();
+}
+
+void Client::leaveIdle()
+{
+    idle = false;
+    syslog(LOG_DEBUG, "traffic resumed");
+
+    // the server held the last poll for longer than it waits on active
+    // clients, the silence so far does not count
+    lastServerReply = now;
+
+    if (maxPolls != 0)
+    {
+        // the polls for the answers go out with the first packet instead of
+        // trickling in as the window grows again
+        pollWindow = idlePollWindow;
+        receivedPackets = 0;
+        rateSampleStart = now;
+        sendPolls(pollWindow - 1);
+        setStateTimeout(POLL_INTERVAL);
+    }
+    else
+    {
+        keepAliveInterval = MODE_PROBE_DELAY;
+        setStateTimeout(keepAliveInterval);
+    }
+}
+
+void Client::startBindingDiscovery()
+{
+    uint32_t needed = CAPABILITY_MODE_PROBE | CAPABILITY_IDLE_POLLS;
+    if ((capabilities & needed) != needed || bindingMeasured || modeStep != MODE_STEP_NONE)
+        return;
+
+    bindingMeasured = true;
+    probeBinding();
+}
+
+void Client::probeBinding()
+{
+    // doubled until a late reply does not get through, then narrowed down
+    // like the path mtu
+    bindingProbe = bindingHigh == 0 ? 2 * bindingLow : (bindingLow + bindingHigh) / 2;
+    if (bindingProbe > IDLE_MAX_KEEPALIVE)
+        bindingProbe = IDLE_MAX_KEEPALIVE;
+
+    modeStep = MODE_STEP_BINDING;
+    modeProbeTries = 0;
+    sendModeProbe();
+}
+
+void Client::finishBindingStep(bool passed)
+{
+    if (passed)
+        bindingLow = bindingProbe;
+    else
+        bindingHigh = bindingProbe;
+    modeStep = MODE_STEP_NONE;
+
+    if (bindingLow < IDLE_MAX_KEEPALIVE && (bindingHigh == 0 || bindingHigh - bindingLow > IDLE_PRECISION))
+    {
+        probeBinding();
+        return;
+    }
+
+    syslog(LOG_INFO, "idle keep alives every %d s", bindingLow / 1000);
+
+    if (!idle)
+        return;
+
+    if (maxPolls != 0)
+    {
+        // tells the server the new time
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        setStateTimeout(bindingLow * 3 / 2);
+    }
+    else
+    {
+        keepAliveInterval = bindingLow;
+    }
+}
+
+int Client::findPath(uint32_t realIp, uint32_t localIp)
+{
+    for (int i = 0; i < paths.size(); i++)
+        if (paths[i].serverIp == realIp &&
+            (paths[i].localIp == 0 || localIp == 0 || paths[i].localIp == localIp))
+            return i;
+
+    return -1;
+}
+
+int Client::pathCount()
+{
+    if (state != STATE_ESTABLISHED || (capabilities & CAPABILITY_MULTIPATH) == 0)
+        return 1;
+    return paths.size();
+}
+
+int Client::pathWeight(const Path &path)
+{
+    // a path that stopped answering only keeps the share that finds out
+    // when it works again
+    if (path.lastRequest - path.lastReply > PATH_DOWN_TIME)
+        return 0;
+
+    // paths without a sample yet are assumed to be as fast as the average
+    int pathRtt = path.rttValid ? path.rtt : rtt;
+    return (1000 - path.loss) * 1000 / (pathRtt + 1);
+}
+
+void Client::updatePathLoss(Path &path, uint32_t counters)
+{
+    LossSample sample = takeLossSample(path.sentRequests, path.receivedReplies, counters);
+
+    if (!path.lossSampleValid)
+    {
+        path.lossSample = sample;
+        path.lossSampleValid = true;
+        return;
+    }
+
+    if ((now - path.lossSample.time).getMilliseconds() < PATH_SAMPLE_INTERVAL)
+        return;
+
+    if ((uint16_t)(sample.sentRequests - path.lossSample.sentRequests) >= PATH_MIN_SAMPLES)
+        path.loss = (3 * path.loss + measureLoss(path.lossSample, sample)) / 4;
+
+    path.lossSample = sample;
+}
+
+int Client::selectPath(bool poll)
+{
+    int count = pathCount();
+
+    // anything else sent on a path the server has not taken up yet would be
+    // lost, a poll now and then gets it to challenge the address
+    if (poll)
+        for (int i = 0; i < count; i++)
+            if (!paths[i].confirmed && !(now < paths[i].lastRequest + PATH_CHALLENGE_INTERVAL))
+                return i;
+
+    int maxWeight = 0;
+    for (int i = 0; i < count; i++)
+        if (paths[i].confirmed && pathWeight(paths[i]) > maxWeight)
+            maxWeight = pathWeight(paths[i]);
+
+    // smooth weighted round robin, every path keeps a small share so its
+    // loss and round trip time stay known
+    int minWeight = maxWeight * PATH_MIN_WEIGHT / 100 + 1;
+    int total = 0;
+    int best = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!paths[i].confirmed)
+            continue;
+
+        int weight = pathWeight(paths[i]);
+        paths[i].credit += weight > minWeight ? weight : minWeight;
+        total += weight > minWeight ? weight : minWeight;
+
+        if (paths[i].credit > paths[best].credit)
+            best = i;
+    }
+
+    paths[best].credit -= total;
+    return best;
+}
+
+void Client::startPolling()
+{
+    if (maxPolls == 0)
+    {
+        setStateTimeout(keepAliveInterval);
+    }
+    else
+    {
+        receivedPackets = 0;
+        rateSampleStart = now;
+        recentPolls.clear();
+
+        sendPolls(pollWindow);
+        setStateTimeout(POLL_INTERVAL);
+    }
+}
+
+void Client::sendPolls(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (pacedPackets.empty() && pacedPolls == 0 && pacer.consume(now))
+        {
+            sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        }
+        else if (pacedPolls < maxPollWindow)
+        {
+            pacedPolls++;
+            pacerLimited = true;
+        }
+    }
+
+    updateTimeout();
+}
+
+void Client::sendData(int dataLength)
+{
+    if (pacedPackets.empty() && pacer.consume(now))
+    {
+        sendEchoToServer(TunnelHeader::TYPE_DATA, dataLength);
+        return;
+    }
+
+    if (pacedPackets.size() == MAX_BUFFERED_PACKETS)
+    {
+        pacedPackets.pop();
+        queueDrops++;
+        syslog(LOG_WARNING, "paced packet dropped");
+    }
+
+    pacedPackets.push(Packet());
+    Packet &packet = pacedPackets.back();
+    packet.type = TunnelHeader::TYPE_DATA;
+    packet.data.resize(dataLength);
+    memcpy(&packet.data[0], echoSendPayloadBuffer(), dataLength);
+
+    pacerLimited = true;
+    updateTimeout();
+}
+
+void Client::sendPacedEchoes()
+{
+    while ((!pacedPackets.empty() || pacedPolls > 0) && pacer.consume(now))
+    {
+        // data first, the polls only matter once the data is out
+        if (!pacedPackets.empty())
+        {
+            Packet &packet = pacedPackets.front();
+            memcpy(echoSendPayloadBuffer(), &packet.data[0], packet.data.size());
+            sendEchoToServer(packet.type, packet.data.size());
+            pacedPackets.pop();
+        }
+        else
+        {
+            pacedPolls--;
+            sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        }
+    }
+}
+
+Client::LossSample Client::takeLossSample(uint16_t sentRequests, uint16_t receivedReplies, uint32_t counters)
+{
+    LossSample sample;
+    sample.time = now;
+    sample.sentRequests = sentRequests;
+    sample.receivedReplies = receivedReplies;
+    sample.serverReceivedRequests = counters >> 16;
+    sample.serverSentReplies = counters & 0xffff;
+    return sample;
+}
+
+int Client::measureLoss(const LossSample &from, const LossSample &to)
+{
+    int sent = (uint16_t)(to.sentRequests - from.sentRequests);
+    int arrived = (uint16_t)(to.serverReceivedRequests - from.serverReceivedRequests);
+    int replies = (uint16_t)(to.serverSentReplies - from.serverSentReplies);
+    int received = (uint16_t)(to.receivedReplies - from.receivedReplies);
+
+    // fraction of echoes that made it there and back, in permille
+    int upstream = arrived < sent ? arrived * 1000 / sent : 1000;
+    int downstream = received < replies ? received * 1000 / replies : 1000;
+    return 1000 - upstream * downstream / 1000;
+}
+
+void Client::updatePacingRate(uint32_t counters)
+{
+    LossSample sample = takeLossSample(sentRequests, receivedReplies, counters);
+
+    if (!lossSampleValid)
+    {
+        lossSample = sample;
+        lossSampleValid = true;
+        return;
+    }
+
+    int elapsed = (now - lossSample.time).getMilliseconds();
+    if (elapsed < PACER_INTERVAL || elapsed < 4 * rtt)
+        return;
+
+    int sent = (uint16_t)(sample.sentRequests - lossSample.sentRequests);
+    int arrived = (uint16_t)(sample.serverReceivedRequests - lossSample.serverReceivedRequests);
+    int loss = measureLoss(lossSample, sample);
+
+    lossSample = sample;
+
+    if (sent < PACER_MIN_SAMPLES)
+        return;
+
+    int deliveredRate = arrived * 1000 / elapsed;
+    int rate = pacer.getRate();
+
+    if (loss > PACER_LOSS_THRESHOLD)
+    {
+        // sending faster than what gets through only adds to the loss
+        rate = deliveredRate > PACER_MIN_RATE ? deliveredRate : PACER_MIN_RATE;
+        if (pacer.getRate() == 0 || rate < pacer.getRate())
+            syslog(LOG_DEBUG, "%d.%d%% echo loss, pacing at %d echoes/s",
+                   loss / 10, loss % 10, rate);
+    }
+    else if (rate != 0 && pacerLimited)
+    {
+        // probe for more bandwidth
+        rate += rate / 8 + 1;
+    }
+    else
+    {
+        pacerLimited = false;
+        return;
+    }
+
+    int burst = rate * PACER_GRANULARITY / 1000;
+    pacer.setRate(rate, burst > PACER_MIN_BURST ? burst : PACER_MIN_BURST);
+    pacerLimited = false;
+}
+
+void Client::predictPolls(int expectedReplies)
+{
+    // the answers to requests, new connections and lookups arrive about a
+    // round trip later, polls sent now are there to carry them
+    if (maxPolls == 0 || state != STATE_ESTABLISHED)
+        return;
+
+    // the request carrying the packet is stored as a poll as well
+    int outstanding = serverPolls + pollsInFlight() + pacedPolls + 1;
+    int polls = expectedReplies - outstanding;
+    if (polls > maxPollWindow - outstanding)
+        polls = maxPollWindow - outstanding;
+    if (polls <= 0)
+        return;
+
+    // the server only keeps as many as the window
+    if (pollWindow < outstanding + polls)
+        pollWindow = outstanding + polls;
+
+    DEBUG_ONLY(cout << "predicted polls: " << polls << endl);
+    sendPolls(polls);
+}
+
+void Client::setStateTimeout(Time delta)
+{
+    stateTimeout = now + delta;
+    updateTimeout();
+}
+
+void Client::updateTimeout()
+{
+    Time next = stateTimeout;
+
+    // while idle, reprobes wait for the traffic to resume
+    Time mtuTimeout = mtuProbeSize != 0 ? mtuProbeTimeout : idle ? Time::ZERO : mtuReprobe;
+    if (mtuTimeout != Time::ZERO && (next == Time::ZERO || mtuTimeout < next))
+        next = mtuTimeout;
+
+    Time modeTimeout = modeStep != MODE_STEP_NONE ? modeProbeTimeout : idle ? Time::ZERO : modeReprobe;
+    if (modeTimeout != Time::ZERO && (next == Time::ZERO || modeTimeout < next))
+        next = modeTimeout;
+
+    Time reorderTimeout = reorder.nextTimeout();
+    if (reorderTimeout != Time::ZERO && (next == Time::ZERO || reorderTimeout < next))
+        next = reorderTimeout;
+
+    if (!pacedPackets.empty() || pacedPolls > 0)
+    {
+        Time release = now + pacer.timeUntilAvailable(now);
+        if (next == Time::ZERO || release < next)
+            next = release;
+    }
+
+    if (next != Time::ZERO)
+        setTimeout(next - now);
+}
+
+int Client::pollsInFlight()
+{
+    // polls sent within the last half round trip have not reached the server
+    // when it reported its status
+    Time oneWayDelay = rtt / 2;
+    while (!recentPolls.empty() && recentPolls.front() + oneWayDelay < now)
+        recentPolls.pop_front();
+
+    return recentPolls.size();
+}
+
+void Client::updateRtt(int sample)
+{
+    if (sample < 0 || sample > KEEP_ALIVE_INTERVAL)
+        return;
+
+    rtt = rttValid ? rtt + (sample - rtt) / 8 : sample;
+
+    if (!rttValid || sample <= minRtt || minRttStamp + MIN_RTT_WINDOW < now)
+    {
+        minRtt = sample;
+        minRttStamp = now;
+    }
+
+    rttValid = true;
+}
+
+void Client::updatePollWindow()
+{
+    receivedPackets++;
+
+    int elapsed = (now - rateSampleStart).getMilliseconds();
+    if (elapsed >= RATE_SAMPLE_INTERVAL && elapsed >= minRtt)
+    {
+        int rate = receivedPackets * 1000 / elapsed;
+        deliveryRate = rate > deliveryRate ? rate : deliveryRate - deliveryRate / 8;
+
+        receivedPackets = 0;
+        rateSampleStart = now;
+    }
+
+    if (!rttValid)
+        return;
+
+    // twice the bandwidth-delay product leaves room for the rate to grow
+    int window = 2 * deliveryRate * minRtt / 1000;
+
+    if (window < MIN_POLL_WINDOW)
+        window = MIN_POLL_WINDOW;
+    if (window > maxPollWindow)
+        window = maxPollWindow;
+
+    pollWindow = window;
+}
+
+void Client::handleDataFromServer(int dataLength)
+{
+    if (dataLength == 0)
+    {
+        syslog(LOG_WARNING, "received empty data packet");
+        return;
+    }
+
+    lastTraffic = now;
+    if (idle)
+        leaveIdle();
+
+    uint32_t sequence;
+    if (!receivedOptions.get(TunnelHeader::FLAG_SEQUENCE, sequence) ||
+        reorder.add(sequence, echoReceivePayloadBuffer(), dataLength, now))
+        sendToTun(dataLength);
+    deliverReordered();
+
+    if (maxPolls == 0)
+        return;
+
+    if (receivedOptions.flags & TunnelHeader::FLAG_POLL_STATUS)
+        updatePollWindow();
+
+    replacePolls();
+}
+
+void Client::handlePathChallenge(int path, int dataLength)
+{
+    if (dataLength != sizeof(PathChallenge) || (capabilities & CAPABILITY_MULTIPATH) == 0)
+        return;
+
+    // returned from the address it was sent to, with our mac
+    char *buffer = echoSendPayloadBuffer();
+    memcpy(buffer, echoReceivePayloadBuffer(), sizeof(PathChallenge));
+    Auth::Response mac = Auth::getMac(sessionKey, buffer, sizeof(PathChallenge));
+    memcpy(buffer + sizeof(PathChallenge), &mac, sizeof(Auth::Response));
+
+    // the server counts the requests of the path from this answer on
+    paths[path].counted = true;
+    sendEchoToServer(TunnelHeader::TYPE_PATH_CHALLENGE, sizeof(PathChallenge) + sizeof(Auth::Response),
+                     NULL, path);
+}
+
+void Client::deliverReordered()
+{
+    vector<char> data;
+    while (reorder.next(data, now))
+        tun.write(&data[0], data.size());
+}
+
+void Client::handlePollRefresh()
+{
+    if (maxPolls == 0)
+        return;
+
+    // the poll sat unused at the server, so the window is larger than
+    // what the link needs right now
+    int interval = rttValid ? rtt : HANDSHAKE_INITIAL_TIMEOUT;
+    if (!idle && !(now < pollWindowShrunk + interval))
+    {
+        pollWindowShrunk = now;
+        pollWindow = pollWindow / 2 > MIN_POLL_WINDOW ? pollWindow / 2 : MIN_POLL_WINDOW;
+        if (pollWindow > maxPollWindow)
+            pollWindow = maxPollWindow;
+    }
+
+    replacePolls();
+}
+
+void Client::replacePolls()
+{
+    uint32_t status;
+    if (!receivedOptions.get(TunnelHeader::FLAG_POLL_STATUS, status))
+    {
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+        return;
+    }
+
+    int pending = status >> 16;
+    int outstanding = (status & 0xffff) + pollsInFlight() + pacedPolls;
+    int polls = pollWindow - outstanding;
+
+    // the server has more data waiting than we left polls for
+    if (polls < pending)
+        polls = pending < maxPollWindow - outstanding ? pending : maxPollWindow - outstanding;
+
+    sendPolls(polls < MAX_POLL_BURST ? polls : MAX_POLL_BURST);
+}
+
+void Client::handleTunData(int dataLength, uint32_t, uint32_t)
+{
+    if (state == STATE_ESTABLISHED)
+    {
+        // the polls sent for the answers leave the packet in the buffer alone
+        lastTraffic = now;
+        if (idle)
+            leaveIdle();
+
+        int expectedReplies = PacketQueue::expectedReplies(echoSendPayloadBuffer(), dataLength);
+        sendData(dataLength);
+        predictPolls(expectedReplies);
+        return;
+    }
+
+    if (state == STATE_CLOSED)
+        return;
+
+    // the first packets of a connection are worth keeping until the
+    // handshake is done, applications would take seconds to retransmit
+    dropExpiredPackets();
+    if (heldPackets.size() == MAX_BUFFERED_PACKETS)
+        heldPackets.pop_front();
+
+    heldPackets.push_back(HeldPacket());
+    heldPackets.back().queued = now;
+    heldPackets.back().data.assign(echoSendPayloadBuffer(), echoSendPayloadBuffer() + dataLength);
+}
+
+void Client::dropExpiredPackets()
+{
+    while (!heldPackets.empty() && heldPackets.front().queued + HOLD_TIME < now)
+        heldPackets.pop_front();
+}
+
+void Client::releaseHeldPackets()
+{
+    dropExpiredPackets();
+
+    while (!heldPackets.empty())
+    {
+        HeldPacket &packet = heldPackets.front();
+        memcpy(echoSendPayloadBuffer(), &packet.data[0], packet.data.size());
+        sendData(packet.data.size());
+        heldPackets.pop_front();
+    }
+}
+
+void Client::handleTimeout()
+{
+    sendPacedEchoes();
+    deliverReordered();
+
+    if (stateTimeout != Time::ZERO && !(now < stateTimeout))
+    {
+        stateTimeout = Time::ZERO;
+
+        switch (state)
+        {
+            case STATE_CONNECTION_REQUEST_SENT:
+            case STATE_CHALLENGE_RESPONSE_SENT:
+            case STATE_RESUME_SENT:
+                if (racing && raceNext < raceOrder.size())
+                {
+                    sendNextAttempt();
+                }
+                else
+                {
+                    forgetRefusals();
+                    connect();
+                }
+                break;
+
+            case STATE_ESTABLISHED:
+            {
+                // servers that refresh polls answer each one within their
+                // poll timeout, nothing coming back means they are gone.
+                // without polling, a keep alive might get lost
+                bool probing = maxPolls == 0 && autoPolling;
+                bool polling = (capabilities & CAPABILITY_POLL_REFRESH) && maxPolls != 0;
+                int silence = SERVER_TIMEOUT + (idle ? 2 * bindingLow : 0);
+                if ((polling && now - lastServerReply > silence) ||
+                    (probing && unansweredKeepAlives >= 2))
+                {
+                    syslog(LOG_WARNING, "server %s is not responding",
+                           Utility::formatIp(servers[currentServer].ip).data());
+                    servers[currentServer].down = true;
+                    forgetRefusals();
+                    connect();
+                    break;
+                }
+
+                if (!idle && (polling || probing) && (capabilities & CAPABILITY_IDLE_POLLS) &&
+                    now - lastTraffic > IDLE_TIMEOUT)
+                {
+                    enterIdle();
+                    break;
+                }
+
+                // the idle poll or its refresh got lost, it is replaced
+                if (idle && polling)
+                {
+                    if (now - lastServerReply > bindingLow)
+                        sendPolls(1);
+                    setStateTimeout(bindingLow * 3 / 2);
+                    break;
+                }
+
+                // polling was turned off by the mode discovery, keep alives
+                // are sent as probes so the server answers them
+                if (probing)
+                {
+                    ModeProbe *probe = (ModeProbe *)echoSendPayloadBuffer();
+                    probe->kind = ModeProbe::KIND_REQUEST;
+                    probe->replies = 1;
+                    probe->delay = 0;
+                    probe->token = 0;
+                    sendEchoToServer(TunnelHeader::TYPE_MODE_PROBE, sizeof(ModeProbe));
+                    unansweredKeepAlives++;
+                }
+                else
+                {
+                    sendPolls(1);
+                }
+
+                setStateTimeout(maxPolls == 0 ? keepAliveInterval : POLL_INTERVAL);
+                break;
+            }
+            case STATE_CLOSED:
+                break;
+        }
+    }
+
+    if (mtuProbeSize != 0 && !(now < mtuProbeTimeout))
+    {
+        // a lost probe is only taken for a too large one after a retry
+        if (mtuProbeTries < PMTU_PROBE_TRIES)
+        {
+            sendMtuProbe();
+        }
+        else
+        {
+            mtuProbeHigh = mtuProbeSize - 1;
+            nextMtuProbe();
+        }
+    }
+    else if (mtuReprobe != Time::ZERO && !(now < mtuReprobe) && state == STATE_ESTABLISHED && !idle)
+    {
+        // the path might carry larger packets by now
+        mtuReprobe = Time::ZERO;
+        startMtuDiscovery();
+    }
+
+    if (modeStep != MODE_STEP_NONE && !(now < modeProbeTimeout))
+    {
+        finishModeStep();
+    }
+    else if (modeReprobe != Time::ZERO && !(now < modeReprobe) && state == STATE_ESTABLISHED &&
+             modeStep == MODE_STEP_NONE && !idle)
+    {
+        // the middleboxes on the path might have changed
+        modeReprobe = Time::ZERO;
+        startModeDiscovery();
+    }
+
+    updateTimeout();
+}
+
+void Client::run()
+{
+    now = Time::now();
+
+    connect();
 
     Worker::run();
 }
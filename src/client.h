@@ -22,16 +22,28 @@
 
 #include "worker.h"
 #include "auth.h"
+#include "tokenbucket.h"
+#include "reorderbuffer.h"
+#include "packetqueue.h"
 
 #include <vector>
+#include <deque>
+#include <queue>
 
 class Client : public Worker
 {
 
 public:
-    Client(int tunnelMtu, const std::string *deviceName, uint32_t serverIp,
+    // the first of the servers to answer a handshake is used. handshakes go
+    // to its own address, the path addresses and the source addresses form
+    // additional paths if the server supports multipath. with autoPolling
+    // and autoRotation, polling and the echo id rotation are chosen by
+    // probing the path.
+    Client(int tunnelMtu, const std::string *deviceName, const std::vector<uint32_t> &serverIps,
+           const std::vector<uint32_t> &pathIps, const std::vector<uint32_t> &sourceIps,
            int maxPolls, const std::string &passphrase, uid_t uid, gid_t gid,
-           bool changeEchoId, bool changeEchoSeq, uint32_t desiredIp);
+           bool changeEchoId, bool changeEchoSeq, bool autoPolling, bool autoRotation,
+           int echoStreams, uint32_t desiredIp, int socketBufferSize);
     virtual ~Client();
 
     virtual void run();
@@ -43,34 +55,254 @@ protected:
         STATE_CLOSED,
         STATE_CONNECTION_REQUEST_SENT,
         STATE_CHALLENGE_RESPONSE_SENT,
+        STATE_RESUME_SENT,
         STATE_ESTABLISHED
     };
 
+    struct LossSample
+    {
+        Time time;
+        uint16_t sentRequests;
+        uint16_t receivedReplies;
+        uint16_t serverReceivedRequests;
+        uint16_t serverSentReplies;
+    };
+
+    // a server address and local address pair of a multipath session
+    struct Path
+    {
+        uint32_t serverIp;
+        uint32_t localIp; // 0 leaves the choice to the routing table
+
+        bool rttValid;
+        int rtt;
+        int loss; // permille
+
+        uint16_t sentRequests;
+        uint16_t receivedReplies;
+        bool lossSampleValid;
+        LossSample lossSample;
+
+        Time lastRequest;
+        Time lastReply;
+        bool confirmed; // answered since the session began, the server may challenge it first
+        bool counted; // the server counts what arrives on it
+
+        int credit; // for the weighted round robin
+    };
+
+    // a server that may be chosen, handshakes to all of them race
+    struct Candidate
+    {
+        uint32_t ip;
+        bool legacy; // speaks protocol version 1
+        std::vector<char> ticket; // resumption ticket from its last accept
+        int rtt; // of its last connection, -1 if unknown
+        bool refused; // full or redirected us, skipped until we connect or time out
+        bool down; // stopped answering, tried last
+        int redirect; // position in the latest redirect, -1 if not named
+
+        State attempt; // handshake sent in the current race, STATE_CLOSED if none
+        int attempts;
+        Time attemptSent;
+    };
+
+    // echo ids used in turn, middleboxes and receivers that hash on the id
+    // see several flows
+    struct EchoStream
+    {
+        uint16_t id;
+        uint16_t sequence;
+    };
+
     virtual bool handleEchoData(const TunnelHeader &header, int dataLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
     virtual void handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp);
     virtual void handleTimeout();
 
     void handleDataFromServer(int length);
+    void deliverReordered();
+
+    int findServer(uint32_t realIp);
+    int addServer(uint32_t ip);
+    int raceRank(const Candidate &server);
+    void selectServer(int index);
+    void connect();
+    void forgetRefusals();
+    void sendNextAttempt();
+    void finishRace(int server);
+    bool handleRedirect(int dataLength);
+
+    int findPath(uint32_t realIp, uint32_t localIp);
+    int pathCount();
+    int selectPath(bool poll);
+    int pathWeight(const Path &path);
+    void updatePathLoss(Path &path, uint32_t counters);
+
+    void dropExpiredPackets();
+    void releaseHeldPackets();
+    void handlePollRefresh();
+    void replacePolls();
 
     void startPolling();
+    void sendPolls(int count);
+    void predictPolls(int expectedReplies);
+    int pollsInFlight();
+
+    void updateRtt(int sample);
+    void updatePollWindow();
+
+    void startModeDiscovery();
+    void sendModeProbe();
+    void handleModeProbe(int dataLength);
+    bool modeStepPassed();
+    void finishModeStep();
+    void setPolling(bool enable);
+    void resetMode();
+
+    void enterIdle();
+    void leaveIdle();
+    void startBindingDiscovery();
+    void probeBinding();
+    void finishBindingStep(bool passed);
 
-    void sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength);
-    void sendChallengeResponse(int dataLength);
+    bool startMtuDiscovery();
+    void sendMtuProbe();
+    void nextMtuProbe();
+    void handleMtuProbe(int dataLength);
+    void finishMtuDiscovery();
+
+    void sendEchoToServer(Worker::TunnelHeader::Type type, int dataLength, EchoStream *echoId = NULL,
+                          int pathIndex = -1); // -1 picks the path for the type
+    void handlePathChallenge(int path, int dataLength);
+    void sendData(int dataLength); // from echoSendPayloadBuffer
+    void sendPacedEchoes();
+    void updatePacingRate(uint32_t counters);
+    LossSample takeLossSample(uint16_t sentRequests, uint16_t receivedReplies, uint32_t counters);
+    static int measureLoss(const LossSample &from, const LossSample &to);
+
+    void setStateTimeout(Time delta);
+    void updateTimeout();
+    void sendChallengeResponse(int dataLength, bool cookie = false);
     void sendConnectionRequest();
+    void sendResume();
+    void setHandshakeTimeout();
+    void handshakeReplyReceived();
 
     Auth auth;
 
-    uint32_t serverIp;
+    std::vector<Candidate> servers;
+    int currentServer; // -1 before the first handshake
+    bool racing;
+    std::vector<int> raceOrder;
+    int raceNext;
+    int redirects; // followed since the last connection
+    Auth::Challenge redirectNonce; // sent with the connection requests
+    Time lastServerReply;
+
+    std::vector<uint32_t> pathIps;
+    std::vector<uint32_t> sourceIps;
+    std::vector<Path> paths; // of the current server
+    uint16_t sentSequence; // of data on multipath sessions
+    uint16_t sentRequestSequence; // of everything else on multipath sessions
+    ReorderBuffer reorder;
+
     uint32_t clientIp;
     uint32_t desiredIp;
 
-    int maxPolls;
+    int maxPolls; // initial poll window, 0 disables polling
+    int configuredPolls; // polled with when the path needs it
+    int keepAliveInterval; // without polling
     int pollTimeoutNr;
 
+    int pollWindow;
+    int maxPollWindow;
+    int serverPolls; // stored at the server as of its latest reply
+    Time pollWindowShrunk; // refreshes come in batches, the window is halved once per round trip
+    std::deque<Time> recentPolls;
+
+    bool rttValid;
+    int rtt;
+    int minRtt;
+    Time minRttStamp;
+
+    int receivedPackets;
+    int deliveryRate; // packets per second
+    Time rateSampleStart;
+
+    TokenBucket pacer;
+    std::queue<Packet> pacedPackets;
+    int pacedPolls;
+    bool pacerLimited;
+
+
+    uint16_t sentRequests;
+    uint16_t receivedReplies;
+    bool lossSampleValid;
+    LossSample lossSample;
+
+    Time stateTimeout;
+
     bool changeEchoId, changeEchoSeq;
 
-    uint16_t nextEchoId;
-    uint16_t nextEchoSequence;
+    std::vector<EchoStream> echoStreams;
+    int nextEchoStream;
+
+    uint32_t capabilities;
+    uint32_t sessionId; // assigned by the server, 0 if none
+    Auth::Challenge sessionKey; // authenticates packets from a new address
+
+    // tun packets read while the connection is not up yet
+    struct HeldPacket
+    {
+        Time queued;
+        std::vector<char> data;
+    };
+
+    std::deque<HeldPacket> heldPackets;
+
+    // path mtu discovery, all sizes are of whole echo packets
+    int pathMtu; // size the tunnel mtu is set for
+    int mtuProbeLow; // largest size known to get through
+    int mtuProbeHigh;
+    int mtuProbeSize; // 0 while not probing
+    int mtuProbeTries;
+    Time mtuProbeTimeout;
+    Time mtuReprobe;
+
+    // transport mode discovery, one step after the other
+    enum ModeStep
+    {
+        MODE_STEP_NONE,
+        MODE_STEP_REUSE, // two requests with the same id and sequence number
+        MODE_STEP_SEQUENCE, // two requests with the same id
+        MODE_STEP_REPLIES, // several replies to one request and a late one
+        MODE_STEP_BINDING // one reply after the binding lifetime in question
+    };
+
+    bool autoPolling;
+    bool autoRotation;
+    ModeStep modeStep;
+    int modeProbeTries;
+    uint32_t modeProbeToken;
+    EchoStream modeProbeId;
+    int modeProbeReplies; // received for the current step
+    bool modeProbeDelayed;
+    Time modeProbeTimeout;
+    Time modeReprobe;
+    int unansweredKeepAlives; // sent as probes while not polling
+
+    // without tunnel traffic, a single poll is held by the server for as
+    // long as middleboxes keep its id, which is measured with late replies
+    bool idle;
+    Time lastTraffic;
+    int idlePollWindow; // restored when traffic resumes
+    bool bindingMeasured;
+    int bindingLow; // ms a binding is known to last
+    int bindingHigh; // ms it did not last, 0 if not seen yet
+    int bindingProbe; // delay of the current probe
+
+    int handshakeRetries; // packets sent since the last handshake reply
+    Time handshakeSent;
 
     State state;
 };
@@ -18,11 +18,92 @@
  */
 
 #define MAX_BUFFERED_PACKETS 20
+#define HOLD_TIME 3000 // how long packets wait for a connection to come up
 
 #define KEEP_ALIVE_INTERVAL (60 * 1000)
 #define POLL_INTERVAL 2000
 
+#define MIN_POLL_WINDOW 4
+#define MAX_POLL_WINDOW 1024
+#define MAX_POLL_BURST 64
+#define PREDICTED_BURST 10 // segments answering a tcp request, a usual initial congestion window
+#define MAX_ECHO_STREAMS 16 // echo ids a client polls with at once
+#define RATE_SAMPLE_INTERVAL 50
+#define MIN_RTT_WINDOW (10 * 1000)
+
+#define PACER_INTERVAL 200
+#define PACER_MIN_SAMPLES 20
+#define PACER_LOSS_THRESHOLD 50 // permille
+#define PACER_MIN_RATE 10
+#define PACER_MIN_BURST 4
+#define PACER_GRANULARITY 5
+
+#define SHAPER_BURST_TIME 10
+#define SHAPER_MIN_BURST 2
+
+#define INTERACTIVE_PACKET_SIZE 128
+#define PRIORITY_QUANTUM (16 * 1024) // bytes a class sends before lower classes get a turn
+
 #define CHALLENGE_SIZE 20
+#define HANDSHAKE_INITIAL_TIMEOUT 1000
+#define HANDSHAKE_MIN_TIMEOUT 100
+#define HANDSHAKE_MAX_TIMEOUT 8000
+#define SERVER_ATTEMPT_DELAY 250 // before the next server gets a handshake
+#define SERVER_TIMEOUT 8000 // without replies while polling
+#define MAX_SERVERS 16 // including those we were redirected to
+#define COOKIE_LIFETIME 10 // seconds, cookies are valid for one to two of these
+#define MAX_PENDING_HANDSHAKES 16
+#define TICKET_LIFETIME (24 * 60 * 60) // seconds
+#define MAX_REDIRECT_PEERS 8
+#define REDIRECT_NONCE_SIZE 8 // sent with connection requests, binds redirects to them
+#define LOAD_SAMPLE_INTERVAL 1000
+
+#define PMTU_MIN_SIZE 576 // echo size every path has to carry
+#define PMTU_PRECISION 8 // bytes the search may end below the path mtu
+#define PMTU_PROBE_TRIES 2
+#define PMTU_PROBE_TIMEOUT 1000 // until the round trip time is known
+#define PMTU_MIN_TIMEOUT 100
+#define PMTU_REPROBE_INTERVAL (10 * 60 * 1000)
+#define PMTU_CACHE_LIFETIME (10 * 60 * 1000) // of sizes learned from icmp errors
+
+#define MODE_PROBE_REPLIES 4 // sent at once to one request
+#define MODE_PROBE_DELAY 5000 // of the unsolicited reply, also the keep alive interval without polling
+#define MODE_PROBE_TIMEOUT 1000 // until the round trip time is known
+#define MODE_MIN_TIMEOUT 200
+#define MODE_PROBE_TRIES 2
+#define MODE_REPROBE_INTERVAL (2 * 60 * 1000)
+#define MODE_MAX_REPLIES 8
+#define MODE_MAX_DELAY IDLE_MAX_KEEPALIVE
+
+#define IDLE_TIMEOUT 10000 // without tunnel traffic until the client goes idle
+#define IDLE_MAX_KEEPALIVE (60 * 1000) // longest poll hold, below the server's client timeout
+#define IDLE_PRECISION 5000 // of the measured binding lifetime
+
+#define MAX_PATHS 8 // addresses a multipath session may use
+#define PATH_REPLAY_WINDOW 1000 // ms a new path's timestamp may lag behind
+#define PATH_SAMPLE_INTERVAL 1000
+#define PATH_MIN_SAMPLES 10
+#define PATH_DOWN_TIME 2000 // without replies while sending
+#define PATH_CHALLENGE_INTERVAL 500 // between polls on a path the server has not taken up
+#define PATH_MIN_WEIGHT 5 // percent of the best path's share
+#define REORDER_WINDOW 64 // has to divide 65536
+#define REORDER_TIMEOUT 30
+#define REPLAY_WINDOW 1024 // sequence numbers, has to divide 65536
+
+#define SEND_RETRY_QUEUE 64 // packets held per descriptor while the kernel is full
+#define SEND_RETRY_INTERVAL 2 // ms between retries after ENOBUFS
+
+#define ECHO_SOCKET_BUFFER (256 * 1024) // bytes, to start with
+#define ECHO_MAX_SOCKET_BUFFER (4 * 1024 * 1024) // grown to while the kernel drops echoes
+#define DROP_STATS_INTERVAL 10000
+
+#define ADMISSION_TABLE_SIZE 1024
+#define ADMISSION_SOURCE_RATE 10 // requests per second
+#define ADMISSION_SOURCE_BURST 20
+#define ADMISSION_GLOBAL_RATE 500
+#define ADMISSION_GLOBAL_BURST 1000
+
+#define PROTOCOL_VERSION 2
 
 // #define DEBUG_ONLY(a) a
 #define DEBUG_ONLY(a)
@@ -19,6 +19,8 @@
 
 #include "echo.h"
 #include "exception.h"
+#include "utility.h"
+#include "config.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -27,21 +29,81 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 
+#ifdef LINUX
+#include <linux/errqueue.h>
+#endif
+
 typedef ip IpHeader;
 
-Echo::Echo(int maxPayloadSize)
+Echo::Echo(int maxPayloadSize, int socketBufferSize)
 {
     fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
     if (fd == -1)
         throw Exception("creating icmp socket", true);
 
+    // a full send queue must not stall the receiving side as well
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+        throw Exception("setting icmp socket non-blocking", true);
+
     bufferSize = maxPayloadSize + headerSize();
+    dontFragment = false;
+    pmtuDiscovery = 0;
+    receiveErrors = false;
+    waitWritable = false;
+    kernelDropCounter = 0;
+    resetStats();
+
+    autoSocketBuffer = socketBufferSize == 0;
+    if (autoSocketBuffer)
+        socketBufferSize = ECHO_SOCKET_BUFFER;
+
+    // the defaults only hold a few dozen echoes, too few for a burst
+    receiveSocketBuffer = socketBufferSize;
+    sendSocketBuffer = socketBufferSize;
+    syslog(LOG_DEBUG, "icmp socket buffers: %d bytes receive, %d bytes send",
+           setSocketBuffer(true, socketBufferSize), setSocketBuffer(false, socketBufferSize));
+
+    int value = 1;
+
+#ifdef IP_RECVERR
+    // tells us about echoes the path could not carry, instead of only
+    // fragmenting later ones
+    if (setsockopt(fd, IPPROTO_IP, IP_RECVERR, &value, sizeof(value)) == -1)
+        syslog(LOG_WARNING, "could not enable icmp error reporting: %s", strerror(errno));
+    else
+        receiveErrors = true;
+#endif
+
+#ifdef IP_PKTINFO
+    // with several addresses, replies have to come from the one the
+    // request was sent to
+    if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &value, sizeof(value)) == -1)
+        syslog(LOG_WARNING, "could not enable packet info: %s", strerror(errno));
+#endif
+
+    // the time we get to read an echo depends on the scheduler and on how
+    // many came in before
+#if defined(SO_TIMESTAMPNS)
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &value, sizeof(value)) == -1)
+        syslog(LOG_WARNING, "could not enable receive timestamps: %s", strerror(errno));
+#elif defined(SO_TIMESTAMP)
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &value, sizeof(value)) == -1)
+        syslog(LOG_WARNING, "could not enable receive timestamps: %s", strerror(errno));
+#endif
+
+#ifdef SO_RXQ_OVFL
+    // every echo read then carries the number the kernel dropped so far
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) == -1)
+        syslog(LOG_WARNING, "could not enable drop counting: %s", strerror(errno));
+#endif
+
     sendBuffer.resize(bufferSize);
     receiveBuffer.resize(bufferSize);
 }
@@ -51,45 +113,281 @@ Echo::~Echo()
     close(fd);
 }
 
+void Echo::resetStats()
+{
+    stats.kernelDrops = 0;
+    stats.queueDrops = 0;
+}
+
+int Echo::setSocketBuffer(bool receive, int size)
+{
+    int option = receive ? SO_RCVBUF : SO_SNDBUF;
+
+    // privileged, the size is not capped by net.core.rmem_max and wmem_max
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+    int forceOption = receive ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+    if (setsockopt(fd, SOL_SOCKET, forceOption, &size, sizeof(size)) == -1)
+#endif
+        if (setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size)) == -1)
+            syslog(LOG_WARNING, "could not set icmp socket buffer: %s", strerror(errno));
+
+    int actual = 0;
+    socklen_t length = sizeof(actual);
+    if (getsockopt(fd, SOL_SOCKET, option, &actual, &length) == -1)
+        return size;
+    return actual;
+}
+
+void Echo::growSocketBuffer(bool receive)
+{
+    int &current = receive ? receiveSocketBuffer : sendSocketBuffer;
+    if (!autoSocketBuffer || current >= ECHO_MAX_SOCKET_BUFFER)
+        return;
+
+    current = current * 2 > ECHO_MAX_SOCKET_BUFFER ? ECHO_MAX_SOCKET_BUFFER : current * 2;
+    int size = setSocketBuffer(receive, current);
+
+    // without privileges, the kernel caps the size and it is no use trying again
+    if (size < current)
+        current = ECHO_MAX_SOCKET_BUFFER;
+
+    syslog(LOG_DEBUG, "icmp %s buffer grown to %d bytes", receive ? "receive" : "send", size);
+}
+
+void Echo::countKernelDrops(uint32_t counter)
+{
+    // the counter only grows and wraps around
+    uint32_t drops = counter - kernelDropCounter;
+    kernelDropCounter = counter;
+
+    if (drops == 0)
+        return;
+
+    stats.kernelDrops += drops;
+    growSocketBuffer(true);
+}
+
 int Echo::headerSize()
 {
     return sizeof(IpHeader) + sizeof(EchoHeader);
 }
 
-void Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq)
+void Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                int payloadOffset, uint32_t localIp)
 {
-    struct sockaddr_in target;
-    target.sin_family = AF_INET;
-    target.sin_addr.s_addr = htonl(realIp);
-
-    if (payloadLength + sizeof(IpHeader) + sizeof(EchoHeader) > bufferSize)
+    if (payloadOffset + payloadLength + sizeof(IpHeader) + sizeof(EchoHeader) > bufferSize)
         throw Exception("packet too big");
 
-    EchoHeader *header = (EchoHeader *)(sendBuffer.data() + sizeof(IpHeader));
+    // the echo header goes right in front of the payload
+    char *packet = sendBuffer.data() + sizeof(IpHeader) + payloadOffset;
+
+    EchoHeader *header = (EchoHeader *)packet;
     header->type = reply ? 0: 8;
     header->code = 0;
     header->id = htons(id);
     header->seq = htons(seq);
     header->chksum = 0;
-    header->chksum = icmpChecksum(sendBuffer.data() + sizeof(IpHeader), payloadLength + sizeof(EchoHeader));
+    header->chksum = Utility::checksum(packet, payloadLength + sizeof(EchoHeader));
+
+    int length = payloadLength + sizeof(EchoHeader);
+
+    // echoes go out in order, behind the ones still waiting
+    if (retryQueue.empty() && transmit(packet, length, realIp, localIp))
+        return;
+
+    // probes are repeated by the caller, and would lose their don't
+    // fragment bit on the way
+    if (dontFragment)
+        return;
+
+    if (retryQueue.size() == SEND_RETRY_QUEUE)
+    {
+        retryQueue.pop_front();
+        stats.queueDrops++;
+        syslog(LOG_DEBUG, "echo dropped, send queue full");
+    }
+
+    retryQueue.push_back(QueuedEcho());
+    QueuedEcho &queued = retryQueue.back();
+    queued.packet.assign(packet, packet + length);
+    queued.realIp = realIp;
+    queued.localIp = localIp;
+}
+
+void Echo::flush()
+{
+    while (!retryQueue.empty())
+    {
+        QueuedEcho &queued = retryQueue.front();
+        if (!transmit(&queued.packet[0], queued.packet.size(), queued.realIp, queued.localIp))
+            return;
+        retryQueue.pop_front();
+    }
+}
 
-    int result = sendto(fd, sendBuffer.data() + sizeof(IpHeader), payloadLength + sizeof(EchoHeader), 0, (struct sockaddr *)&target, sizeof(struct sockaddr_in));
+bool Echo::transmit(const char *packet, int length, uint32_t realIp, uint32_t localIp)
+{
+    struct sockaddr_in target;
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = htonl(realIp);
+
+    struct iovec vector;
+    vector.iov_base = (char *)packet;
+    vector.iov_len = length;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &target;
+    message.msg_namelen = sizeof(target);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+#ifdef IP_PKTINFO
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    if (localIp != 0)
+    {
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+        struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+        info->ipi_spec_dst.s_addr = htonl(localIp);
+    }
+#endif
+
+    int result = sendmsg(fd, &message, 0);
     if (result == -1)
-        syslog(LOG_ERR, "error sending icmp packet: %s", strerror(errno));
+    {
+        // the socket buffer frees up as packets leave, a full device
+        // queue only shows in the error, so it is polled
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        {
+            waitWritable = errno != ENOBUFS;
+            if (waitWritable)
+                growSocketBuffer(false);
+            return false;
+        }
+
+        // unfragmented packets exceeding the mtu of the interface are
+        // expected to fail
+        if (errno == EMSGSIZE && dontFragment)
+            syslog(LOG_DEBUG, "packet of %d bytes exceeds the mtu",
+                   (int)(length + sizeof(IpHeader)));
+        else
+            syslog(LOG_ERR, "error sending icmp packet: %s", strerror(errno));
+    }
+
+    return true;
 }
 
-int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+bool Echo::setDontFragment(bool dontFragment)
+{
+    if (this->dontFragment == dontFragment)
+        return true;
+
+    int result = -1;
+
+#if defined(IP_MTU_DISCOVER)
+    if (dontFragment)
+    {
+        socklen_t length = sizeof(pmtuDiscovery);
+        if (getsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtuDiscovery, &length) == -1)
+            pmtuDiscovery = IP_PMTUDISC_WANT;
+    }
+
+#ifdef IP_PMTUDISC_PROBE
+    // ignores the path mtu cached by the kernel, so larger sizes can be
+    // probed again
+    int value = dontFragment ? IP_PMTUDISC_PROBE : pmtuDiscovery;
+#else
+    int value = dontFragment ? IP_PMTUDISC_DO : pmtuDiscovery;
+#endif
+    result = setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+#elif defined(IP_DONTFRAG)
+    int value = dontFragment;
+    result = setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &value, sizeof(value));
+#else
+    errno = ENOTSUP;
+#endif
+
+    if (result == -1)
+    {
+        syslog(LOG_ERR, "could not set the don't fragment bit: %s", strerror(errno));
+        return false;
+    }
+
+    this->dontFragment = dontFragment;
+    return true;
+}
+
+int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq, uint32_t &localIp,
+                  Time &arrival)
 {
     struct sockaddr_in source;
-    int source_addr_len = sizeof(struct sockaddr_in);
 
-    int dataLength = recvfrom(fd, receiveBuffer.data(), bufferSize, 0, (struct sockaddr *)&source, (socklen_t *)&source_addr_len);
+    struct iovec vector;
+    vector.iov_base = receiveBuffer.data();
+    vector.iov_len = bufferSize;
+
+    char control[256];
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &source;
+    message.msg_namelen = sizeof(source);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    // the socket also becomes readable when only the error queue has
+    // something for us
+    int dataLength = recvmsg(fd, &message, MSG_DONTWAIT);
     if (dataLength == -1)
     {
-        syslog(LOG_ERR, "error receiving icmp packet: %s", strerror(errno));
+        // with IP_RECVERR the error of a sent packet is also returned here
+        // once, the details are read from the error queue
+        if (errno != EAGAIN && errno != EWOULDBLOCK && !receiveErrors)
+            syslog(LOG_ERR, "error receiving icmp packet: %s", strerror(errno));
         return -1;
     }
 
+    localIp = 0;
+    arrival = Time::ZERO;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+#ifdef IP_PKTINFO
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+            localIp = ntohl(((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr.s_addr);
+#endif
+#if defined(SO_TIMESTAMPNS)
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            arrival.getTimeval().tv_sec = stamp.tv_sec;
+            arrival.getTimeval().tv_usec = stamp.tv_nsec / 1000;
+        }
+#elif defined(SO_TIMESTAMP)
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP)
+            memcpy(&arrival.getTimeval(), CMSG_DATA(cmsg), sizeof(struct timeval));
+#endif
+#ifdef SO_RXQ_OVFL
+        // only there once the kernel has dropped something
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            uint32_t counter;
+            memcpy(&counter, CMSG_DATA(cmsg), sizeof(counter));
+            countKernelDrops(counter);
+        }
+#endif
+    }
+
     if (dataLength < sizeof(IpHeader) + sizeof(EchoHeader))
         return -1;
 
@@ -105,19 +403,57 @@ int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
     return dataLength - sizeof(IpHeader) - sizeof(EchoHeader);
 }
 
-uint16_t Echo::icmpChecksum(const char *data, int length)
+bool Echo::receiveError(uint32_t &realIp, int &mtu)
 {
-    uint16_t *data16 = (uint16_t *)data;
-    uint32_t sum = 0;
+#ifdef IP_RECVERR
+    if (!receiveErrors)
+        return false;
 
-    for (sum = 0; length > 1; length -= 2)
-        sum += *data16++;
-    if (length == 1)
-        sum += *(unsigned char *)data16;
+    char data[sizeof(EchoHeader)]; // start of the packet that caused the error
+    char control[256];
+    struct sockaddr_in target;
+
+    struct iovec vector;
+    vector.iov_base = data;
+    vector.iov_len = sizeof(data);
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &target;
+    message.msg_namelen = sizeof(target);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    int dataLength = recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (dataLength == -1)
+        return false;
+
+    realIp = ntohl(target.sin_addr.s_addr);
+    mtu = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR)
+            continue;
+
+        const struct sock_extended_err *error = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+
+        // errors from the network quote the packet, other programs' echoes
+        // are reported to raw sockets as well
+        const EchoHeader *header = (const EchoHeader *)data;
+        bool echo = error->ee_origin == SO_EE_ORIGIN_LOCAL ||
+                    (dataLength >= (int)sizeof(EchoHeader) && (header->type == 0 || header->type == 8));
+
+        if (error->ee_errno == EMSGSIZE && echo)
+            mtu = error->ee_info;
+    }
 
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return ~sum;
+    return true;
+#else
+    return false;
+#endif
 }
 
 char *Echo::sendPayloadBuffer()
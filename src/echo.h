@@ -20,20 +20,50 @@
 #ifndef ECHO_H
 #define ECHO_H
 
+#include "time.h"
+
 #include <string>
 #include <vector>
+#include <deque>
 #include <stdint.h>
 
 class Echo
 {
 public:
-    Echo(int maxPayloadSize);
+    struct Stats
+    {
+        int kernelDrops; // echoes the kernel had no room for before we read them
+        int queueDrops;
+    };
+
+    Echo(int maxPayloadSize, int socketBufferSize = 0); // 0 grows the buffers as needed
     ~Echo();
 
     int getFd() { return fd; }
 
-    void send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
-    int receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq);
+    // localIp selects the source address, 0 leaves it to the routing table.
+    // echoes the kernel has no room for are queued and sent by flush
+    void send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+              int payloadOffset = 0, uint32_t localIp = 0);
+
+    bool backlogged() const { return !retryQueue.empty(); }
+    bool waitsForWrite() const { return !retryQueue.empty() && waitWritable; } // else retried later
+    void flush();
+
+    const Stats &getStats() const { return stats; }
+    void resetStats();
+    // localIp is the address the echo was sent to, 0 if unknown
+    // arrival is the time the kernel received the echo, Time::ZERO if unknown
+    int receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq, uint32_t &localIp,
+                Time &arrival);
+
+    // reads an error the system reported for a sent echo, returns false once
+    // there are none left, mtu is 0 unless the echo was too big for the path
+    bool receiveError(uint32_t &realIp, int &mtu);
+
+    // sets the don't fragment bit on the packets sent from now on,
+    // returns false if the system does not support it
+    bool setDontFragment(bool dontFragment);
 
     char *sendPayloadBuffer();
     char *receivePayloadBuffer();
@@ -49,12 +79,36 @@ protected:
         uint16_t seq;
     }; // size = 8
 
-    uint16_t icmpChecksum(const char *data, int length);
+    struct QueuedEcho
+    {
+        std::vector<char> packet; // from the echo header on
+        uint32_t realIp;
+        uint32_t localIp;
+    };
+
+    bool transmit(const char *packet, int length, uint32_t realIp, uint32_t localIp);
+
+    int setSocketBuffer(bool receive, int size);
+    void growSocketBuffer(bool receive);
+    void countKernelDrops(uint32_t counter);
 
     int fd;
     int bufferSize;
+    bool dontFragment;
+    bool receiveErrors; // IP_RECVERR is set
+    int pmtuDiscovery; // socket setting to restore when fragmenting again
     std::vector<char> sendBuffer;
     std::vector<char> receiveBuffer;
+
+    std::deque<QueuedEcho> retryQueue;
+    bool waitWritable; // the socket buffer was full, not the device queue
+
+    bool autoSocketBuffer;
+    int receiveSocketBuffer; // as requested, the kernel may report more
+    int sendSocketBuffer;
+    uint32_t kernelDropCounter;
+
+    Stats stats;
 };
 
 #endif
@@ -20,6 +20,7 @@
 #include "client.h"
 #include "server.h"
 #include "exception.h"
+#include "config.h"
 
 #include <iostream>
 #include <arpa/inet.h>
@@ -36,6 +37,7 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include <memory>
+#include <algorithm>
 
 #ifndef AI_V4MAPPED // Not supported on OpenBSD 6.0
 #define AI_V4MAPPED 0
@@ -65,12 +67,19 @@ static void usage()
         "Hans - IP over ICMP version 1.1\n\n"
         "RUN AS CLIENT\n"
         "  hans -c server [-fv] [-p passphrase] [-u user] [-d tun_device]\n"
-        "       [-m reference_mtu] [-w polls]\n\n"
+        "       [-m reference_mtu] [-w polls] [-P address] [-S address]\n"
+        "       [-b buffer]\n\n"
         "RUN AS SERVER (linux only)\n"
         "  hans -s network [-fvr] [-p passphrase] [-u user] [-d tun_device]\n"
-        "       [-m reference_mtu] [-a ip]\n\n"
+        "       [-m reference_mtu] [-a ip] [-l rate] [-B burst] [-L rate]\n"
+        "       [-R address] [-T load] [-b buffer]\n\n"
         "ARGUMENTS\n"
-        "  -c server     Run as client. Connect to given server address.\n"
+        "  -c server     Run as client. Connect to given server address. May be given\n"
+        "                several times, handshakes then go to all servers shortly\n"
+        "                after another and the first one to answer is used. When it\n"
+        "                stops answering, the client switches to the next one. The\n"
+        "                servers should use the same network, the tunnel address\n"
+        "                can only change while running as root.\n"
         "  -s network    Run as server. Use given network address on virtual interfaces.\n"
         "  -p passphrase Set passphrase.\n"
         "  -u username   Change user under which the program runs.\n"
@@ -79,22 +88,82 @@ static void usage()
         "  -d device     Use given tun device.\n"
         "  -m mtu        Set maximum echo packet size. This should correspond to the MTU\n"
         "                of the network between client and server, which is usually 1500\n"
-        "                over Ethernet. Has to be the same on client and server. Defaults\n"
-        "                to 1500.\n"
+        "                over Ethernet. Defaults to 1500. If the server supports it,\n"
+        "                the client probes the path for the largest size that gets\n"
+        "                through and lowers the tunnel MTU to match. The server uses it\n"
+        "                as the upper limit and sizes the packets for each client to\n"
+        "                what the client found.\n"
         "  -w polls      Number of echo requests the client sends in advance for the\n"
         "                server to reply to. 0 disables polling, which is the best choice\n"
         "                if the network allows unlimited echo replies. Defaults to 10.\n"
+        "                If the server supports it, the number is adapted to the measured\n"
+        "                bandwidth and round trip time, up to 1024. Without -w, the\n"
+        "                client turns polling off by itself if the server supports it\n"
+        "                and the path lets replies through without it.\n"
         "  -i            Change echo id on every echo request. May help with buggy\n"
         "                routers. May impact performance with others.\n"
         "  -q            Change echo sequence number on every echo request. May help with\n"
-        "                buggy routers. May impact performance with others.\n"
+        "                buggy routers. May impact performance with others. Without -i\n"
+        "                and -q, the client probes which of them the path needs if the\n"
+        "                server supports it.\n"
+        "  -e ids        Number of echo ids to use at once, up to 16. Requests take\n"
+        "                them in turn and the server answers them in turn, so\n"
+        "                routers and NICs that hash on the id spread the load.\n"
+        "                Defaults to 1.\n"
+        "  -l rate       Limit the data sent to each client to the given rate in\n"
+        "                kbit/s. Replies are paced instead of sent in bursts.\n"
+        "  -B burst      Number of bytes a client may receive in a burst when -l\n"
+        "                is given. Defaults to 10 ms worth of data.\n"
+        "  -L rate       Limit the data sent to all clients together to the given\n"
+        "                rate in kbit/s.\n"
+        "  -R address    Another server new clients are sent to when this one is\n"
+        "                full. May be given several times, the clients are spread\n"
+        "                over all of them.\n"
+        "  -T load       Also send new clients to the servers given with -R while\n"
+        "                this percentage of cpu time or queue space or more is in\n"
+        "                use. Clients are only sent on once for this.\n"
+        "  -P address    Another address of the server. Data and polls are spread\n"
+        "                over all paths by their round trip time and loss if the\n"
+        "                server supports it. May be given several times, with one\n"
+        "                server only.\n"
+        "  -S address    Local address to send from. Every one forms a path with\n"
+        "                each server address. May be given several times.\n"
+        "  -b buffer     Size of the icmp socket buffers in kilobytes. Without it,\n"
+        "                they start at 256 and grow up to 4096 while the kernel\n"
+        "                drops echoes or has no room for them.\n"
         "  -f            Run in foreground.\n"
         "  -v            Print debug information.\n";
 }
 
+static bool resolve(const string &name, uint32_t &ip)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+
+    hints.ai_family = AF_INET;
+    hints.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG;
+
+    int err = getaddrinfo(name.data(), NULL, &hints, &res);
+    if (err)
+    {
+        syslog(LOG_ERR, "getaddrinfo: %s", gai_strerror(err));
+        return false;
+    }
+
+    sockaddr_in *sockaddr = reinterpret_cast<sockaddr_in *>(res->ai_addr);
+    ip = ntohl(sockaddr->sin_addr.s_addr);
+
+    freeaddrinfo(res);
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
-    string serverName;
+    std::vector<string> serverNames;
+    std::vector<string> pathNames;
+    std::vector<string> peerNames;
+    int loadThreshold = 0;
+    std::vector<uint32_t> sourceIps;
     string userName;
     string passphrase;
     string device;
@@ -103,6 +172,9 @@ int main(int argc, char *argv[])
     bool foreground = false;
     int mtu = 1500;
     int maxPolls = 10;
+    int clientRate = 0;
+    int clientBurst = 0;
+    int egressRate = 0;
     uint32_t network = INADDR_NONE;
     uint32_t clientIp = INADDR_NONE;
     bool answerPing = false;
@@ -110,12 +182,16 @@ int main(int argc, char *argv[])
     gid_t gid = 0;
     bool changeEchoId = false;
     bool changeEchoSeq = false;
+    bool autoPolling = true;
+    bool autoRotation = true;
+    int echoStreams = 1;
+    int socketBufferSize = 0;
     bool verbose = false;
 
     openlog(argv[0], LOG_PERROR, LOG_DAEMON);
 
     int c;
-    while ((c = getopt(argc, argv, "fru:d:p:s:c:m:w:qiva:")) != -1)
+    while ((c = getopt(argc, argv, "fru:d:p:s:c:m:w:qie:va:l:B:L:P:S:R:T:b:")) != -1)
     {
         switch(c) {
             case 'f':
@@ -133,7 +209,7 @@ int main(int argc, char *argv[])
                 break;
             case 'c':
                 isClient = true;
-                serverName = optarg;
+                serverNames.push_back(optarg);
                 break;
             case 's':
                 isServer = true;
@@ -146,15 +222,21 @@ int main(int argc, char *argv[])
                 break;
             case 'w':
                 maxPolls = atoi(optarg);
+                autoPolling = false;
                 break;
             case 'r':
                 answerPing = true;
                 break;
             case 'q':
                 changeEchoSeq = true;
+                autoRotation = false;
                 break;
             case 'i':
                 changeEchoId = true;
+                autoRotation = false;
+                break;
+            case 'e':
+                echoStreams = atoi(optarg);
                 break;
             case 'v':
                 verbose = true;
@@ -162,6 +244,32 @@ int main(int argc, char *argv[])
             case 'a':
                 clientIp = ntohl(inet_addr(optarg));
                 break;
+            case 'l':
+                clientRate = atoi(optarg) * 1000 / 8;
+                break;
+            case 'B':
+                clientBurst = atoi(optarg);
+                break;
+            case 'L':
+                egressRate = atoi(optarg) * 1000 / 8;
+                break;
+            case 'P':
+                pathNames.push_back(optarg);
+                break;
+            case 'R':
+                peerNames.push_back(optarg);
+                break;
+            case 'T':
+                loadThreshold = atoi(optarg);
+                break;
+            case 'b':
+                socketBufferSize = atoi(optarg) * 1024;
+                break;
+            case 'S':
+                sourceIps.push_back(ntohl(inet_addr(optarg)));
+                if (sourceIps.back() == INADDR_NONE)
+                    std::cerr << "invalid source address\n";
+                break;
             default:
                 usage();
                 return 1;
@@ -180,8 +288,16 @@ int main(int argc, char *argv[])
 
     if ((isClient == isServer) ||
         (isServer && network == INADDR_NONE) ||
-        (maxPolls < 0 || maxPolls > 255) ||
-        (isServer && (changeEchoSeq || changeEchoId)))
+        (maxPolls < 0 || maxPolls > MAX_POLL_WINDOW) ||
+        (clientRate < 0 || clientBurst < 0 || egressRate < 0) ||
+        socketBufferSize < 0 ||
+        (echoStreams < 1 || echoStreams > MAX_ECHO_STREAMS) ||
+        (isServer && (changeEchoSeq || changeEchoId || echoStreams != 1 ||
+                      !pathNames.empty() || !sourceIps.empty())) ||
+        (serverNames.size() > 1 && !pathNames.empty()) ||
+        (loadThreshold < 0 || (loadThreshold != 0 && peerNames.empty())) ||
+        (isClient && (!peerNames.empty() || loadThreshold != 0)) ||
+        std::count(sourceIps.begin(), sourceIps.end(), INADDR_NONE) != 0)
     {
         usage();
         return 1;
@@ -217,32 +333,32 @@ int main(int argc, char *argv[])
     {
         if (isServer)
         {
+            std::vector<uint32_t> peerIps(peerNames.size());
+            for (int i = 0; i < peerNames.size(); i++)
+                if (!resolve(peerNames[i], peerIps[i]))
+                    return 1;
+
             worker = new Server(mtu, device.empty() ? NULL : &device, passphrase,
-                                network, answerPing, uid, gid, 5000);
+                                network, answerPing, uid, gid, 5000,
+                                clientRate, clientBurst, egressRate, peerIps, loadThreshold,
+                                socketBufferSize);
         }
         else
         {
-            struct addrinfo hints = {0};
-            struct addrinfo *res = NULL;
-
-            hints.ai_family = AF_INET;
-            hints.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG;
+            std::vector<uint32_t> serverIps(serverNames.size());
+            for (int i = 0; i < serverNames.size(); i++)
+                if (!resolve(serverNames[i], serverIps[i]))
+                    return 1;
 
-            int err = getaddrinfo(serverName.data(), NULL, &hints, &res);
-            if (err)
-            {
-                syslog(LOG_ERR, "getaddrinfo: %s", gai_strerror(err));
-                return 1;
-            }
-
-            sockaddr_in *sockaddr = reinterpret_cast<sockaddr_in *>(res->ai_addr);
-            uint32_t serverIp = sockaddr->sin_addr.s_addr;
+            std::vector<uint32_t> pathIps(pathNames.size());
+            for (int i = 0; i < pathNames.size(); i++)
+                if (!resolve(pathNames[i], pathIps[i]))
+                    return 1;
 
             worker = new Client(mtu, device.empty() ? NULL : &device,
-                                ntohl(serverIp), maxPolls, passphrase, uid, gid,
-                                changeEchoId, changeEchoSeq, clientIp);
-
-            freeaddrinfo(res);
+                                serverIps, pathIps, sourceIps, maxPolls, passphrase, uid, gid,
+                                changeEchoId, changeEchoSeq, autoPolling, autoRotation,
+                                echoStreams, clientIp, socketBufferSize);
         }
 
         if (!foreground)
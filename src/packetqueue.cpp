@@ -0,0 +1,226 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "packetqueue.h"
+#include "config.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DSCP_LOWER_EFFORT 1
+#define DSCP_CS1 8
+#define DSCP_AF41 34
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+PacketQueue::PacketQueue()
+{
+    count = 0;
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+        credit[i] = PRIORITY_QUANTUM;
+}
+
+PacketQueue::Class PacketQueue::classify(const char *data, int length)
+{
+    const unsigned char *ip = (const unsigned char *)data;
+
+    if (length < 20 || ip[0] >> 4 != 4)
+        return CLASS_DEFAULT;
+
+    int dscp = ip[1] >> 2;
+    if (dscp == DSCP_LOWER_EFFORT || dscp == DSCP_CS1)
+        return CLASS_BULK;
+    if (dscp >= DSCP_AF41)
+        return CLASS_INTERACTIVE;
+
+    if (length <= INTERACTIVE_PACKET_SIZE)
+        return CLASS_INTERACTIVE;
+
+    int headerLength = (ip[0] & 0x0f) * 4;
+    bool firstFragment = (ntohs(*(const uint16_t *)(ip + 6)) & 0x1fff) == 0;
+    const unsigned char *transport = ip + headerLength;
+    int transportLength = length - headerLength;
+
+    switch (ip[9])
+    {
+        case IPPROTO_ICMP:
+            return CLASS_INTERACTIVE;
+        case IPPROTO_TCP:
+        {
+            if (!firstFragment || transportLength < 20)
+                break;
+
+            // pure acks carry no data, delaying them stalls the sender
+            int tcpHeaderLength = (transport[12] >> 4) * 4;
+            uint8_t tcpFlags = transport[13];
+            if ((tcpFlags & (TCP_FIN | TCP_SYN | TCP_RST | TCP_ACK)) == TCP_ACK &&
+                transportLength == tcpHeaderLength)
+                return CLASS_INTERACTIVE;
+            break;
+        }
+        case IPPROTO_UDP:
+        {
+            if (!firstFragment || transportLength < 8)
+                break;
+
+            uint16_t sourcePort = ntohs(*(const uint16_t *)transport);
+            uint16_t destPort = ntohs(*(const uint16_t *)(transport + 2));
+            if (sourcePort == 53 || destPort == 53)
+                return CLASS_INTERACTIVE;
+            break;
+        }
+        default:
+            break;
+    }
+
+    return CLASS_DEFAULT;
+}
+
+int PacketQueue::expectedReplies(const char *data, int length)
+{
+    const unsigned char *ip = (const unsigned char *)data;
+
+    if (length < 20 || ip[0] >> 4 != 4)
+        return 0;
+
+    int headerLength = (ip[0] & 0x0f) * 4;
+    bool firstFragment = (ntohs(*(const uint16_t *)(ip + 6)) & 0x1fff) == 0;
+    const unsigned char *transport = ip + headerLength;
+    int transportLength = length - headerLength;
+
+    if (!firstFragment)
+        return 0;
+
+    switch (ip[9])
+    {
+        case IPPROTO_ICMP:
+            if (transportLength >= 8 && transport[0] == 8) // echo request
+                return 1;
+            break;
+        case IPPROTO_TCP:
+        {
+            if (transportLength < 20)
+                break;
+
+            int tcpHeaderLength = (transport[12] >> 4) * 4;
+            uint8_t tcpFlags = transport[13];
+
+            if ((tcpFlags & (TCP_SYN | TCP_ACK)) == TCP_SYN)
+                return 1;
+
+            // data ending a write, like a request, is answered by up to
+            // the initial window of the peer
+            if ((tcpFlags & TCP_PSH) && !(tcpFlags & (TCP_SYN | TCP_FIN | TCP_RST)) &&
+                transportLength > tcpHeaderLength)
+                return PREDICTED_BURST;
+            break;
+        }
+        case IPPROTO_UDP:
+        {
+            if (transportLength < 8)
+                break;
+
+            uint16_t destPort = ntohs(*(const uint16_t *)(transport + 2));
+            if (destPort == 53)
+                return 1;
+            break;
+        }
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+void PacketQueue::push(const Worker::Packet &packet, Class packetClass)
+{
+    queues[packetClass].push(packet);
+    count++;
+}
+
+int PacketQueue::nextClass() const
+{
+    // strict priority, but a class that used up its credit lets the next
+    // class in use send one packet, which bounds the starvation
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        if (queues[i].empty())
+            continue;
+
+        if (credit[i] >= (int)queues[i].front().data.size())
+            return i;
+
+        for (int j = i + 1; j < CLASS_COUNT; j++)
+            if (!queues[j].empty())
+                return j;
+
+        return i;
+    }
+
+    return -1;
+}
+
+Worker::Packet &PacketQueue::front()
+{
+    return queues[nextClass()].front();
+}
+
+void PacketQueue::pop()
+{
+    int packetClass = nextClass();
+    std::queue<Worker::Packet> &queue = queues[packetClass];
+
+    // the classes above had their turn now
+    for (int i = 0; i < packetClass; i++)
+        credit[i] = PRIORITY_QUANTUM;
+
+    credit[packetClass] -= queue.front().data.size();
+    if (credit[packetClass] < 0)
+        credit[packetClass] = 0;
+
+    queue.pop();
+    count--;
+
+    // a class that ran dry starts over
+    if (queue.empty())
+        credit[packetClass] = PRIORITY_QUANTUM;
+}
+
+bool PacketQueue::dropLowest()
+{
+    for (int i = CLASS_COUNT - 1; i >= 0; i--)
+    {
+        if (queues[i].empty())
+            continue;
+
+        queues[i].pop();
+        count--;
+
+        if (queues[i].empty())
+            credit[i] = PRIORITY_QUANTUM;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,61 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKETQUEUE_H
+#define PACKETQUEUE_H
+
+#include "worker.h"
+
+#include <queue>
+
+// packets waiting for a poll, split into priority classes so short
+// interactive packets do not wait behind bulk transfers
+class PacketQueue
+{
+public:
+    enum Class
+    {
+        CLASS_INTERACTIVE,
+        CLASS_DEFAULT,
+        CLASS_BULK,
+        CLASS_COUNT
+    };
+
+    PacketQueue();
+
+    static Class classify(const char *data, int length); // inner IPv4 packet
+    static int expectedReplies(const char *data, int length); // packets answering it soon
+
+    void push(const Worker::Packet &packet, Class packetClass);
+    Worker::Packet &front();
+    void pop();
+    bool dropLowest(); // drops the oldest packet of the lowest class in use
+
+    bool empty() const { return count == 0; }
+    int size() const { return count; }
+
+protected:
+    int nextClass() const;
+
+    std::queue<Worker::Packet> queues[CLASS_COUNT];
+    int credit[CLASS_COUNT];
+    int count;
+};
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "reorderbuffer.h"
+#include "config.h"
+
+#include <string.h>
+
+ReorderBuffer::ReorderBuffer()
+{
+    entries.resize(REORDER_WINDOW);
+    reset();
+}
+
+void ReorderBuffer::reset()
+{
+    for (int i = 0; i < REORDER_WINDOW; i++)
+    {
+        entries[i].used = false;
+        entries[i].data.clear();
+    }
+
+    ready.clear();
+    expected = 0;
+    synchronized = false;
+    stored = 0;
+}
+
+bool ReorderBuffer::add(uint16_t sequence, const char *data, int length, Time now)
+{
+    if (!synchronized)
+    {
+        expected = sequence;
+        synchronized = true;
+    }
+
+    // the packets stored behind it are picked up by next()
+    int16_t distance = sequence - expected;
+    if (distance == 0)
+    {
+        expected++;
+
+        // packets pushed out of the window before still go first
+        if (ready.empty())
+            return true;
+        ready.push_back(std::vector<char>(data, data + length));
+        return false;
+    }
+
+    // the gap it filled has been given up on already, holding it back
+    // would not restore any order
+    if (distance < 0)
+        return true;
+
+    while (distance >= REORDER_WINDOW)
+    {
+        skip();
+        distance--;
+    }
+
+    Entry &entry = entries[sequence % REORDER_WINDOW];
+    if (entry.used)
+        return false; // duplicate
+
+    entry.used = true;
+    entry.received = now;
+    entry.data.assign(data, data + length);
+    stored++;
+
+    return false;
+}
+
+void ReorderBuffer::skip()
+{
+    Entry &entry = entries[expected % REORDER_WINDOW];
+    if (entry.used)
+    {
+        ready.push_back(std::vector<char>());
+        ready.back().swap(entry.data);
+        entry.used = false;
+        stored--;
+    }
+
+    expected++;
+}
+
+bool ReorderBuffer::next(std::vector<char> &data, Time now)
+{
+    if (ready.empty() && stored != 0)
+    {
+        Time timeout = nextTimeout();
+
+        // everything in front of the oldest stored packet that waited long
+        // enough is lost or too late
+        while (!entries[expected % REORDER_WINDOW].used && !(now < timeout))
+            expected++;
+
+        if (entries[expected % REORDER_WINDOW].used)
+            skip();
+    }
+
+    if (ready.empty())
+        return false;
+
+    data.swap(ready.front());
+    ready.pop_front();
+    return true;
+}
+
+Time ReorderBuffer::nextTimeout() const
+{
+    if (!ready.empty())
+        return Time::ZERO;
+
+    Time oldest;
+    for (int i = 0; i < REORDER_WINDOW; i++)
+        if (entries[i].used && (oldest == Time::ZERO || entries[i].received < oldest))
+            oldest = entries[i].received;
+
+    return oldest == Time::ZERO ? Time::ZERO : oldest + REORDER_TIMEOUT;
+}
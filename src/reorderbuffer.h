@@ -0,0 +1,64 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REORDERBUFFER_H
+#define REORDERBUFFER_H
+
+#include "time.h"
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+// puts data arriving over several paths back in order, a gap is given up
+// on once the packet behind it waited REORDER_TIMEOUT
+class ReorderBuffer
+{
+public:
+    ReorderBuffer();
+
+    // returns true if the packet is next in line, with nothing left in
+    // front of it, or late and can be delivered right away. it is stored
+    // otherwise
+    bool add(uint16_t sequence, const char *data, int length, Time now);
+
+    // the next stored packet that is due
+    bool next(std::vector<char> &data, Time now);
+    Time nextTimeout() const; // ZERO if nothing is stored
+
+    void reset();
+
+protected:
+    struct Entry
+    {
+        bool used;
+        Time received;
+        std::vector<char> data;
+    };
+
+    void skip(); // gives up on the expected packet
+
+    std::vector<Entry> entries; // by sequence number modulo REORDER_WINDOW
+    std::deque<std::vector<char> > ready; // pushed out of the window
+    uint16_t expected;
+    bool synchronized;
+    int stored;
+};
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "replaywindow.h"
+
+#include <string.h>
+
+ReplayWindow::ReplayWindow()
+{
+    reset();
+}
+
+void ReplayWindow::reset()
+{
+    memset(seen, 0, sizeof(seen));
+    highest = 0;
+    synchronized = false;
+}
+
+bool ReplayWindow::check(uint16_t sequence)
+{
+    if (!synchronized)
+    {
+        highest = sequence - 1;
+        synchronized = true;
+    }
+
+    // the numbers passed over are cleared for their next round
+    int16_t distance = sequence - highest;
+    if (distance > 0)
+    {
+        int steps = distance < REPLAY_WINDOW ? distance : REPLAY_WINDOW;
+        for (int i = 1; i <= steps; i++)
+        {
+            uint16_t cleared = highest + i;
+            seen[cleared % REPLAY_WINDOW / 32] &= ~(1u << cleared % 32);
+        }
+        highest = sequence;
+    }
+    else if (distance <= -REPLAY_WINDOW)
+    {
+        return false;
+    }
+
+    uint32_t &word = seen[sequence % REPLAY_WINDOW / 32];
+    uint32_t bit = 1u << sequence % 32;
+    if (word & bit)
+        return false;
+
+    word |= bit;
+    return true;
+}
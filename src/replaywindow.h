@@ -0,0 +1,45 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REPLAYWINDOW_H
+#define REPLAYWINDOW_H
+
+#include "config.h"
+
+#include <stdint.h>
+
+// tells which of the latest sequence numbers were seen already, so a
+// recorded packet sent again is not taken for a late one
+class ReplayWindow
+{
+public:
+    ReplayWindow();
+
+    // true the first time a sequence number within the window is seen
+    bool check(uint16_t sequence);
+
+    void reset();
+
+protected:
+    uint16_t highest;
+    bool synchronized;
+    uint32_t seen[REPLAY_WINDOW / 32]; // by sequence number modulo REPLAY_WINDOW
+};
+
+#endif
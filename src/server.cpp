@@ -24,10 +24,17 @@
 
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
 #include <syslog.h>
+#include <sys/resource.h>
 #include <iostream>
 
+typedef ip IpHeader;
+
 using std::string;
+using std::vector;
 using std::cout;
 using std::endl;
 
@@ -36,12 +43,33 @@ using std::endl;
 const Worker::TunnelHeader::Magic Server::magic("hans");
 
 Server::Server(int tunnelMtu, const string *deviceName, const string &passphrase,
-               uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout)
-    : Worker(tunnelMtu, deviceName, answerEcho, uid, gid), auth(passphrase)
+               uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout,
+               int clientRate, int clientBurst, int egressRate,
+               const vector<uint32_t> &peers, int loadThreshold, int socketBufferSize)
+    : Worker(tunnelMtu, deviceName, answerEcho, uid, gid, socketBufferSize), auth(passphrase),
+      admission(ADMISSION_TABLE_SIZE, ADMISSION_SOURCE_RATE, ADMISSION_SOURCE_BURST,
+                ADMISSION_GLOBAL_RATE, ADMISSION_GLOBAL_BURST)
 {
     this->network = network & 0xffffff00;
     this->pollTimeout = pollTimeout;
     this->latestAssignedIpOffset = FIRST_ASSIGNED_IP_OFFSET - 1;
+    this->cookieSecret = auth.generateChallenge(CHALLENGE_SIZE);
+    this->sessionSlots.resize(256, NULL);
+    this->peers = peers;
+    this->nextPeer = 0;
+    this->loadThreshold = loadThreshold;
+    this->load = 0;
+
+    // by default the buckets hold a few milliseconds worth of full packets
+    int minBurst = SHAPER_MIN_BURST * wireSize(tunnelMtu);
+
+    this->clientRate = clientRate;
+    this->clientBurst = clientBurst != 0 ? clientBurst : clientRate * SHAPER_BURST_TIME / 1000;
+    if (this->clientBurst < minBurst)
+        this->clientBurst = minBurst;
+
+    int egressBurst = egressRate * SHAPER_BURST_TIME / 1000;
+    egressShaper.setRate(egressRate, egressBurst > minBurst ? egressBurst : minBurst);
 
     tun.setIp(this->network + 1, this->network + 2);
 
@@ -57,11 +85,44 @@ void Server::handleUnknownClient(const TunnelHeader &header, int dataLength, uin
 {
     ClientData client;
     client.realIp = realIp;
+    client.tunnelIp = 0;
+    client.sessionId = 0;
+    client.state = ClientData::STATE_NEW;
     client.maxPolls = 1;
+    client.maxPollWindow = 1;
+    client.pollTimeout = pollTimeout;
+    client.version = 1;
+    client.capabilities = 0;
+    client.redirects = 0;
+    client.receivedRequests = 0;
+    client.sentReplies = 0;
+    client.mtu = 0;
+    client.sentSequence = 0;
+    client.untrackedPolls = 0;
+    client.usedPolls = 0;
+    client.refreshedPolls = 0;
+    client.expiredPolls = 0;
+    client.shaper.setRate(clientRate, clientBurst);
+
+    pollReceived(&client, realIp, echoId, echoSeq);
+
+    // nothing is stored for clients answering a cookie until they have
+    // proven to know the passphrase
+    if (header.type == TunnelHeader::TYPE_CHALLENGE_RESPONSE && dataLength > sizeof(Auth::Response))
+    {
+        checkCookieResponse(&client, dataLength);
+        return;
+    }
 
-    pollReceived(&client, echoId, echoSeq);
+    if (header.type == TunnelHeader::TYPE_RESUME)
+    {
+        checkResume(&client, dataLength);
+        return;
+    }
 
-    if (header.type != TunnelHeader::TYPE_CONNECTION_REQUEST || dataLength != sizeof(ClientConnectData))
+    uint32_t desiredIp;
+    if (header.type != TunnelHeader::TYPE_CONNECTION_REQUEST ||
+        !readConnectData(&client, echoReceivePayloadBuffer(), dataLength, desiredIp))
     {
         syslog(LOG_DEBUG, "invalid request (type %d) from %s", header.type,
                Utility::formatIp(realIp).c_str());
@@ -69,31 +130,341 @@ void Server::handleUnknownClient(const TunnelHeader &header, int dataLength, uin
         return;
     }
 
-    ClientConnectData *connectData = (ClientConnectData *)echoReceivePayloadBuffer();
+    // clients are only sent on once, so they are not passed around when
+    // all servers are busy
+    if (loadThreshold != 0 && client.redirects == 0 && load >= loadThreshold && redirectClient(&client))
+        return;
 
-    client.maxPolls = connectData->maxPolls;
-    client.state = ClientData::STATE_NEW;
-    client.tunnelIp = reserveTunnelIp(connectData->desiredIp);
+    if (client.capabilities & CAPABILITY_STATELESS_HANDSHAKE)
+    {
+        // redirects are only followed in reply to the connection request,
+        // so a full server has to say so before the handshake
+        if (!tunnelIpAvailable(desiredIp))
+        {
+            syslog(LOG_WARNING, "server full");
+            refuseClient(&client);
+            return;
+        }
 
-    syslog(LOG_DEBUG, "new client %s with tunnel address %s\n",
+        sendCookie(&client, dataLength);
+        return;
+    }
+
+    // older clients need the challenge stored, but only a limited number
+    // of them may be in the middle of a handshake
+    ClientData *oldestPending = NULL;
+    int pendingHandshakes = 0;
+    for (ClientList::iterator it = clientList.begin(); it != clientList.end(); ++it)
+    {
+        if (it->state != ClientData::STATE_ESTABLISHED)
+        {
+            oldestPending = &*it;
+            pendingHandshakes++;
+        }
+    }
+
+    if (pendingHandshakes >= MAX_PENDING_HANDSHAKES)
+    {
+        syslog(LOG_DEBUG, "too many pending handshakes, dropping the oldest");
+        removeClient(oldestPending);
+    }
+
+    client.tunnelIp = reserveTunnelIp(desiredIp);
+
+    syslog(LOG_DEBUG, "new client %s with tunnel address %s, protocol version %d, capabilities 0x%x\n",
            Utility::formatIp(client.realIp).data(),
-           Utility::formatIp(client.tunnelIp).data());
+           Utility::formatIp(client.tunnelIp).data(),
+           client.version, client.capabilities);
 
     if (client.tunnelIp != 0)
     {
+        // the challenge response does not carry a session id, so the
+        // client is found by its address alone
+        client.capabilities &= ~CAPABILITY_SESSION_ID;
         client.challenge = auth.generateChallenge(CHALLENGE_SIZE);
         sendChallenge(&client);
 
-        // add client to list
-        clientList.push_front(client);
-        clientRealIpMap[realIp] = clientList.begin();
-        clientTunnelIpMap[client.tunnelIp] = clientList.begin();
+        addClient(client);
+    }
+    else
+    {
+        syslog(LOG_WARNING, "server full");
+        refuseClient(&client);
+    }
+}
+
+int Server::writeTicket(ClientData *client, char *buffer)
+{
+    ResumptionTicket *ticket = (ResumptionTicket *)buffer;
+    memset(ticket, 0, sizeof(ResumptionTicket));
+    ticket->issued = htonl(now.getTimeval().tv_sec);
+    ticket->tunnelIp = htonl(client->tunnelIp);
+    ticket->sessionId = htonl(client->sessionId);
+    ticket->maxPolls = htons(client->maxPollWindow);
+    ticket->version = client->version;
+    ticket->capabilities = htonl(client->capabilities);
+
+    Auth::Response mac = Auth::getMac(cookieSecret, buffer, sizeof(ResumptionTicket));
+    memcpy(buffer + sizeof(ResumptionTicket), &mac, sizeof(Auth::Response));
+
+    return TICKET_SIZE;
+}
+
+void Server::checkResume(ClientData *client, int dataLength)
+{
+    const char *payload = echoReceivePayloadBuffer();
+    const ResumptionTicket *ticket = (const ResumptionTicket *)payload;
+
+    bool valid = dataLength == RESUME_SIZE;
+    if (valid)
+    {
+        Auth::Response ticketMac = Auth::getMac(cookieSecret, payload, sizeof(ResumptionTicket));
+        valid = memcmp(&ticketMac, payload + sizeof(ResumptionTicket), sizeof(Auth::Response)) == 0 &&
+                now.getTimeval().tv_sec - ntohl(ticket->issued) < TICKET_LIFETIME;
+    }
+
+    Auth::Challenge sessionKey;
+    if (valid)
+    {
+        // proves that the client knows the passphrase, the timestamp keeps
+        // the request from being replayed while the session is alive
+        sessionKey = auth.getSessionKey(Auth::Challenge(payload, payload + TICKET_SIZE));
+        Auth::Response proof = Auth::getMac(sessionKey, payload, TICKET_SIZE + sizeof(uint32_t));
+        valid = memcmp(&proof, payload + TICKET_SIZE + sizeof(uint32_t), sizeof(Auth::Response)) == 0;
+    }
+
+    uint32_t timestamp = valid ? ntohl(*(const uint32_t *)(payload + TICKET_SIZE)) : 0;
+    uint32_t tunnelIp = valid ? ntohl(ticket->tunnelIp) : 0;
+    uint32_t sessionId = valid ? ntohl(ticket->sessionId) : 0;
+
+    // tickets are single use, otherwise a captured resume could be replayed
+    // from anywhere once the session timed out
+    uint32_t expired = now.getTimeval().tv_sec - TICKET_LIFETIME;
+    while (!usedTickets.empty() && (int32_t)(usedTickets.begin()->first - expired) <= 0)
+        usedTickets.erase(usedTickets.begin());
+
+    // a client whose accept got lost sends its resume again
+    std::pair<uint32_t, uint32_t> ticketId(ntohl(ticket->issued), sessionId);
+    if (valid && usedTickets.count(ticketId))
+    {
+        if (acceptAgain(client, tunnelIp, sessionId))
+            return;
+        valid = false;
+    }
+
+    ClientData *previous = valid ? getClientByTunnelIp(tunnelIp) : NULL;
+    if (previous != NULL)
+    {
+        if (previous->sessionId == sessionId && (int32_t)(timestamp - previous->lastTimestamp) > 0)
+        {
+            holdPackets(previous);
+            removeClient(previous);
+        }
+        else
+            valid = false;
+    }
+
+    if (valid && reserveTunnelIp(tunnelIp) != tunnelIp)
+    {
+        releaseTunnelIp(tunnelIp);
+        valid = false;
+    }
+
+    if (!valid)
+    {
+        // the client falls back to the full handshake
+        syslog(LOG_DEBUG, "invalid resumption ticket from %s", Utility::formatIp(client->realIp).data());
+        sendReset(client);
+        return;
+    }
+
+    usedTickets.insert(ticketId);
+
+    client->tunnelIp = tunnelIp;
+    client->version = ticket->version;
+    client->capabilities = ntohl(ticket->capabilities) & localCapabilities;
+    client->maxPollWindow = ntohs(ticket->maxPolls);
+    client->maxPolls = client->maxPollWindow;
+    client->sessionKey = sessionKey;
+    client->lastTimestamp = timestamp;
+
+    syslog(LOG_DEBUG, "resuming session of %s with tunnel address %s",
+           Utility::formatIp(client->realIp).data(),
+           Utility::formatIp(client->tunnelIp).data());
+
+    acceptClient(addClient(*client, sessionId));
+}
+
+bool Server::readConnectData(ClientData *client, const char *data, int length, uint32_t &desiredIp)
+{
+    if (length < sizeof(ClientConnectData))
+        return false;
+
+    ProtocolInfo info;
+    info.maxPolls = 0;
+
+    if (length != sizeof(ClientConnectData))
+    {
+        if (!readProtocolInfo(data + sizeof(ClientConnectData), length - sizeof(ClientConnectData), info))
+            return false;
+
+        client->version = info.version;
+        client->capabilities = info.capabilities & localCapabilities;
+        client->redirects = info.redirects;
+
+        int nonceOffset = sizeof(ClientConnectData) + sizeof(ProtocolInfo);
+        if (length >= nonceOffset + REDIRECT_NONCE_SIZE)
+            client->redirectNonce.assign(data + nonceOffset, data + nonceOffset + REDIRECT_NONCE_SIZE);
+    }
+
+    const ClientConnectData *connectData = (const ClientConnectData *)data;
+
+    client->maxPolls = connectData->maxPolls;
+    if (info.maxPolls > client->maxPolls)
+        client->maxPolls = info.maxPolls < MAX_POLL_WINDOW ? info.maxPolls : MAX_POLL_WINDOW;
+    client->maxPollWindow = client->maxPolls;
+    desiredIp = connectData->desiredIp;
+
+    return true;
+}
+
+Server::ClientData *Server::addClient(const ClientData &client, uint32_t sessionId)
+{
+    clientList.push_front(client);
+    ClientData *added = &clientList.front();
+
+    // clients with a session id may share their address with others
+    if (added->capabilities & CAPABILITY_SESSION_ID)
+    {
+        int slot = added->tunnelIp & 0xff;
+        added->sessionId = sessionId != 0 ? sessionId : (uint32_t)Utility::rand() << 8 | slot;
+        sessionSlots[slot] = added;
     }
     else
+    {
+        added->sessionId = 0;
+        clientRealIpMap[client.realIp] = clientList.begin();
+    }
+
+    clientTunnelIpMap[client.tunnelIp] = clientList.begin();
+    added->deadline = Time::ZERO;
+    updateTimeout(added);
+    return added;
+}
+
+uint32_t Server::cookieTimeBucket()
+{
+    return now.getTimeval().tv_sec / COOKIE_LIFETIME;
+}
+
+Auth::Response Server::getCookieMac(uint32_t realIp, const char *cookie, int length)
+{
+    // the mac covers the time bucket and the connect data in the cookie
+    // as well as the address it was sent to
+    std::vector<char> data(sizeof(uint32_t) + length);
+    uint32_t ip = htonl(realIp);
+    memcpy(&data[0], &ip, sizeof(uint32_t));
+    memcpy(&data[sizeof(uint32_t)], cookie, length);
+
+    return Auth::getMac(cookieSecret, &data[0], data.size());
+}
+
+void Server::sendCookie(ClientData *client, int dataLength)
+{
+    syslog(LOG_DEBUG, "sending cookie to %s", Utility::formatIp(client->realIp).data());
+
+    // time bucket, connect data and mac, the client returns it with its response
+    char *cookie = echoSendPayloadBuffer();
+    uint32_t bucket = htonl(cookieTimeBucket());
+    memcpy(cookie, &bucket, sizeof(uint32_t));
+    memcpy(cookie + sizeof(uint32_t), echoReceivePayloadBuffer(), dataLength);
+
+    int length = sizeof(uint32_t) + dataLength;
+    Auth::Response mac = getCookieMac(client->realIp, cookie, length);
+    memcpy(cookie + length, &mac, sizeof(Auth::Response));
+    length += sizeof(Auth::Response);
+
+    sendEchoToClient(client, TunnelHeader::TYPE_CHALLENGE_COOKIE, length);
+}
+
+void Server::checkCookieResponse(ClientData *client, int dataLength)
+{
+    const char *response = echoReceivePayloadBuffer();
+    const char *cookie = response + sizeof(Auth::Response);
+    int cookieLength = dataLength - sizeof(Auth::Response);
+    int macOffset = cookieLength - sizeof(Auth::Response);
+
+    bool valid = macOffset > (int)sizeof(uint32_t);
+    if (valid)
+    {
+        uint32_t bucket = ntohl(*(const uint32_t *)cookie);
+        uint32_t currentBucket = cookieTimeBucket();
+        Auth::Response mac = getCookieMac(client->realIp, cookie, macOffset);
+
+        valid = (bucket == currentBucket || bucket + 1 == currentBucket) &&
+                memcmp(&mac, cookie + macOffset, sizeof(Auth::Response)) == 0;
+    }
+
+    if (!valid)
+    {
+        // most likely the cookie expired, the client starts over
+        syslog(LOG_DEBUG, "invalid cookie from %s", Utility::formatIp(client->realIp).data());
+        sendReset(client);
+        return;
+    }
+
+    Auth::Response rightResponse = auth.getResponse(Auth::Challenge(cookie, cookie + cookieLength));
+    if (memcmp(&rightResponse, response, sizeof(Auth::Response)) != 0)
+    {
+        syslog(LOG_DEBUG, "wrong challenge response from %s\n",
+               Utility::formatIp(client->realIp).data());
+        sendEchoToClient(client, TunnelHeader::TYPE_CHALLENGE_ERROR, 0);
+        return;
+    }
+
+    // every cookie starts one session, replays would take an address each
+    uint32_t expired = cookieTimeBucket() - 1;
+    while (!usedCookies.empty() && (int32_t)(usedCookies.begin()->first.first - expired) < 0)
+        usedCookies.erase(usedCookies.begin());
+
+    std::pair<uint32_t, uint32_t> cookieId(ntohl(*(const uint32_t *)cookie),
+                                           *(const uint32_t *)(cookie + macOffset));
+    CookieMap::iterator used = usedCookies.find(cookieId);
+    if (used != usedCookies.end())
+    {
+        if (!acceptAgain(client, used->second.first, used->second.second))
+            syslog(LOG_DEBUG, "used cookie from %s", Utility::formatIp(client->realIp).data());
+        return;
+    }
+
+    uint32_t desiredIp;
+    if (!readConnectData(client, cookie + sizeof(uint32_t), macOffset - sizeof(uint32_t), desiredIp))
+    {
+        sendReset(client);
+        return;
+    }
+
+    client->tunnelIp = reserveTunnelIp(desiredIp);
+
+    syslog(LOG_DEBUG, "new client %s with tunnel address %s, protocol version %d, capabilities 0x%x\n",
+           Utility::formatIp(client->realIp).data(),
+           Utility::formatIp(client->tunnelIp).data(),
+           client->version, client->capabilities);
+
+    if (client->tunnelIp == 0)
     {
         syslog(LOG_WARNING, "server full");
-        sendEchoToClient(&client, TunnelHeader::TYPE_SERVER_FULL, 0);
+        refuseClient(client);
+        return;
     }
+
+    client->sessionKey = auth.getSessionKey(Auth::Challenge(cookie, cookie + cookieLength));
+    client->lastTimestamp = 0;
+    receivedOptions.get(TunnelHeader::FLAG_TIMESTAMP, client->lastTimestamp);
+
+    ClientData *added = addClient(*client);
+    usedCookies[cookieId] = std::make_pair(added->tunnelIp, added->sessionId);
+    acceptClient(added);
 }
 
 void Server::sendChallenge(ClientData *client)
@@ -113,12 +484,17 @@ void Server::removeClient(ClientData *client)
            Utility::formatIp(client->realIp).data(),
            Utility::formatIp(client->tunnelIp).data());
 
+    logPollStats(client);
     releaseTunnelIp(client->tunnelIp);
 
-    ClientList::iterator it = clientRealIpMap[client->realIp];
+    ClientList::iterator it = clientTunnelIpMap[client->tunnelIp];
 
-    clientRealIpMap.erase(client->realIp);
+    if (client->sessionId != 0)
+        sessionSlots[client->tunnelIp & 0xff] = NULL;
+    else
+        clientRealIpMap.erase(client->realIp);
     clientTunnelIpMap.erase(client->tunnelIp);
+    deadlines.erase(std::make_pair(client->deadline, client));
 
     clientList.erase(it);
 }
@@ -138,22 +514,215 @@ void Server::checkChallenge(ClientData *client, int length)
         return;
     }
 
+    acceptClient(client);
+}
+
+void Server::acceptClient(ClientData *client)
+{
     uint32_t *ip = (uint32_t *)echoSendPayloadBuffer();
     *ip = htonl(client->tunnelIp);
 
-    sendEchoToClient(client, TunnelHeader::TYPE_CONNECTION_ACCEPT, sizeof(uint32_t));
+    // older clients only accept the bare ip
+    int acceptLength = sizeof(uint32_t);
+    if (client->version >= 2)
+    {
+        writeProtocolInfo(echoSendPayloadBuffer() + acceptLength, client->maxPollWindow);
+        acceptLength += sizeof(ProtocolInfo);
+    }
+
+    if (client->sessionId != 0)
+    {
+        *(uint32_t *)(echoSendPayloadBuffer() + acceptLength) = htonl(client->sessionId);
+        acceptLength += sizeof(uint32_t);
+
+        if (client->capabilities & CAPABILITY_RESUMPTION)
+            acceptLength += writeTicket(client, echoSendPayloadBuffer() + acceptLength);
+    }
+
+    sendEchoToClient(client, TunnelHeader::TYPE_CONNECTION_ACCEPT, acceptLength);
 
     client->state = ClientData::STATE_ESTABLISHED;
 
+    releaseHeldPackets(client);
+
     syslog(LOG_INFO, "connection established to %s",
            Utility::formatIp(client->realIp).data());
 }
 
+bool Server::acceptAgain(ClientData *client, uint32_t tunnelIp, uint32_t sessionId)
+{
+    // the accept got lost and the client repeats its handshake, it is
+    // answered on the poll id of the repetition
+    ClientData *previous = getClientByTunnelIp(tunnelIp);
+    if (previous == NULL || previous->sessionId != sessionId || previous->realIp != client->realIp ||
+        client->pollIds.empty())
+        return false;
+
+    ClientData::EchoId id = takePollId(client);
+    storePollId(previous, id);
+    acceptClient(previous);
+    return true;
+}
+
 void Server::sendReset(ClientData *client)
 {
     syslog(LOG_DEBUG, "sending reset to %s",
            Utility::formatIp(client->realIp).data());
-    sendEchoToClient(client, TunnelHeader::TYPE_RESET_CONNECTION, 0);
+    // lets the client tell us apart from servers which do not understand
+    // its protocol version, older clients ignore the payload
+    writeProtocolInfo(echoSendPayloadBuffer(), 0);
+    sendEchoToClient(client, TunnelHeader::TYPE_RESET_CONNECTION, sizeof(ProtocolInfo));
+}
+
+bool Server::redirectClient(ClientData *client)
+{
+    if (peers.empty() || (client->capabilities & CAPABILITY_REDIRECT) == 0 || client->redirectNonce.empty())
+        return false;
+
+    // every redirect starts with the next peer, so the clients are spread
+    // over all of them. the client tries them in this order.
+    int count = peers.size() < MAX_REDIRECT_PEERS ? peers.size() : MAX_REDIRECT_PEERS;
+    uint32_t *addresses = (uint32_t *)echoSendPayloadBuffer();
+    for (int i = 0; i < count; i++)
+        addresses[i] = htonl(peers[(nextPeer + i) % peers.size()]);
+    nextPeer = (nextPeer + 1) % peers.size();
+
+    syslog(LOG_DEBUG, "redirecting %s to %s", Utility::formatIp(client->realIp).data(),
+           Utility::formatIp(ntohl(addresses[0])).data());
+
+    // proves to the client that the list comes from a server knowing the
+    // passphrase and answers its connection request
+    int length = count * sizeof(uint32_t);
+    Auth::Response mac = Auth::getMac(auth.getSessionKey(client->redirectNonce), (const char *)addresses, length);
+    memcpy(echoSendPayloadBuffer() + length, &mac, sizeof(Auth::Response));
+
+    sendEchoToClient(client, TunnelHeader::TYPE_REDIRECT, length + sizeof(Auth::Response));
+    return true;
+}
+
+void Server::refuseClient(ClientData *client)
+{
+    if (!redirectClient(client))
+        sendEchoToClient(client, TunnelHeader::TYPE_SERVER_FULL, 0);
+}
+
+void Server::updateLoad()
+{
+    if (now < loadSampleTime + LOAD_SAMPLE_INTERVAL)
+        return;
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    Time cpu, system;
+    cpu.getTimeval() = usage.ru_utime;
+    system.getTimeval() = usage.ru_stime;
+    cpu = cpu + system;
+
+    int elapsed = (now - loadSampleTime).getMilliseconds();
+    int cpuLoad = loadSampleTime == Time::ZERO ? 0 : (cpu - loadSampleCpu).getMilliseconds() * 100 / elapsed;
+    loadSampleTime = now;
+    loadSampleCpu = cpu;
+
+    // packets waiting for polls, of what a client may queue. the fullest
+    // queue counts, idle clients would hide a flooded one in an average.
+    int queued = 0;
+    for (ClientList::iterator it = clientList.begin(); it != clientList.end(); ++it)
+        if (it->pendingPackets.size() > queued)
+            queued = it->pendingPackets.size();
+    int queueLoad = queued * 100 / MAX_BUFFERED_PACKETS;
+
+    int previous = load;
+    load = cpuLoad > queueLoad ? cpuLoad : queueLoad;
+    if (load != previous)
+        syslog(LOG_DEBUG, "load %d%% (cpu %d%%, queues %d%%)", load, cpuLoad, queueLoad);
+}
+
+void Server::handleMtuProbe(ClientData *client, int dataLength)
+{
+    if (dataLength < sizeof(MtuProbe))
+        return;
+
+    const MtuProbe *probe = (const MtuProbe *)echoReceivePayloadBuffer();
+    int size = ntohs(probe->size);
+
+    if (probe->kind == MtuProbe::KIND_REQUEST)
+    {
+        // probes larger than our buffers arrive truncated and go unanswered
+        if (dataLength != mtuProbeLength(size) || client->pollIds.empty())
+            return;
+
+        MtuProbe *reply = (MtuProbe *)echoSendPayloadBuffer();
+        reply->size = probe->size;
+        reply->kind = MtuProbe::KIND_REPLY;
+        reply->reserved = 0;
+        memset(reply + 1, 0, dataLength - sizeof(MtuProbe));
+
+        // the reply probes the path back to the client
+        if (!echo.setDontFragment(true))
+            return;
+        sendEchoToClient(client, TunnelHeader::TYPE_MTU_PROBE, dataLength, takePollId(client));
+        echo.setDontFragment(false);
+    }
+    else if (probe->kind == MtuProbe::KIND_RESULT)
+    {
+        if (size < PMTU_MIN_SIZE || size > maxEchoSize())
+            return;
+
+        if (size != client->mtu)
+            syslog(LOG_DEBUG, "path mtu to %s is %d bytes",
+                   Utility::formatIp(client->tunnelIp).data(), size);
+        client->mtu = size;
+    }
+}
+
+void Server::handleModeProbe(ClientData *client, int dataLength, const ClientData::EchoId &echoId)
+{
+    if (dataLength < sizeof(ModeProbe))
+        return;
+
+    ModeProbe probe = *(const ModeProbe *)echoReceivePayloadBuffer();
+    if (probe.kind != ModeProbe::KIND_REQUEST)
+        return;
+
+    int replies = probe.replies < MODE_MAX_REPLIES ? probe.replies : MODE_MAX_REPLIES;
+    int delay = ntohs(probe.delay) < MODE_MAX_DELAY ? ntohs(probe.delay) : MODE_MAX_DELAY;
+
+    probe.kind = ModeProbe::KIND_REPLY;
+    for (int i = 0; i < replies; i++)
+    {
+        probe.replies = i;
+        memcpy(echoSendPayloadBuffer(), &probe, sizeof(ModeProbe));
+        sendEchoToClient(client, TunnelHeader::TYPE_MODE_PROBE, sizeof(ModeProbe), echoId);
+    }
+
+    // the client waits for a probe and its retry at most
+    if (delay != 0 && client->delayedProbes.size() < MODE_PROBE_TRIES)
+    {
+        ClientData::DelayedProbe delayed(echoId);
+        delayed.due = now + delay;
+        delayed.probe = probe;
+        delayed.probe.replies = replies;
+        client->delayedProbes.push_back(delayed);
+        updateTimeout(client);
+    }
+}
+
+void Server::sendDelayedProbes(ClientData *client)
+{
+    std::vector<ClientData::DelayedProbe>::iterator it = client->delayedProbes.begin();
+    while (it != client->delayedProbes.end())
+    {
+        if (now < it->due)
+        {
+            ++it;
+            continue;
+        }
+
+        memcpy(echoSendPayloadBuffer(), &it->probe, sizeof(ModeProbe));
+        sendEchoToClient(client, TunnelHeader::TYPE_MODE_PROBE, sizeof(ModeProbe), it->echoId);
+        it = client->delayedProbes.erase(it);
+    }
 }
 
 bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq)
@@ -164,14 +733,43 @@ bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
     if (header.magic != Client::magic)
         return false;
 
-    ClientData *client = getClientByRealIp(realIp);
+    ClientData *client = getClient(header, dataLength, realIp);
+
+    // requests that cost a challenge, a reset or a new client are limited
+    // before any work is done for them
+    if ((client == NULL || header.type == TunnelHeader::TYPE_CONNECTION_REQUEST) &&
+        !admission.admit(realIp, now))
+        return true;
+
     if (client == NULL)
     {
         handleUnknownClient(header, dataLength, realIp, id, seq);
         return true;
     }
 
-    pollReceived(client, id, seq);
+    // further addresses of a multipath session are only used once they
+    // answered a challenge, and everything from them has to carry the mac
+    if (realIp != client->realIp)
+    {
+        if (!usesAddress(client, realIp))
+        {
+            handleNewPath(client, header.type, dataLength, realIp, id, seq);
+            return true;
+        }
+
+        if (!checkSessionAuth(client, header.type, dataLength, PATH_REPLAY_WINDOW) ||
+            !checkPathSequence(client, header.type))
+            return true;
+    }
+
+    client->receivedRequests++;
+    if (client->capabilities & CAPABILITY_MULTIPATH)
+        getPathCounters(client, realIp, receivedLocalIp).receivedRequests++;
+    // the replies to a mode probe have to go out on the id of the probe
+    // itself, pollReceived does not hand it out to other packets
+    bool modeProbe = header.type == TunnelHeader::TYPE_MODE_PROBE &&
+                     client->state == ClientData::STATE_ESTABLISHED;
+    pollReceived(client, realIp, id, seq, modeProbe);
 
     switch (header.type)
     {
@@ -183,9 +781,10 @@ bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
             }
 
             while (client->pollIds.size() > 1)
-                client->pollIds.pop();
+                dropOldestPollId(client);
 
             syslog(LOG_DEBUG, "reconnecting %s", Utility::formatIp(realIp).data());
+            holdPackets(client);
             sendReset(client);
             removeClient(client);
             return true;
@@ -199,18 +798,28 @@ bool Server::handleEchoData(const TunnelHeader &header, int dataLength, uint32_t
         case TunnelHeader::TYPE_DATA:
             if (client->state == ClientData::STATE_ESTABLISHED)
             {
-                if (dataLength == 0)
-                {
-                    syslog(LOG_WARNING, "received empty data packet");
-                    return true;
-                }
-
-                sendToTun(dataLength);
+                handleDataFromClient(client, dataLength);
                 return true;
             }
             break;
         case TunnelHeader::TYPE_POLL:
+            if (client->state == ClientData::STATE_ESTABLISHED && (client->capabilities & CAPABILITY_IDLE_POLLS))
+                setPollTimeout(client, dataLength);
             return true;
+        case TunnelHeader::TYPE_MTU_PROBE:
+            if (client->state == ClientData::STATE_ESTABLISHED)
+            {
+                handleMtuProbe(client, dataLength);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_MODE_PROBE:
+            if (client->state == ClientData::STATE_ESTABLISHED)
+            {
+                handleModeProbe(client, dataLength, receivedEchoId(realIp, id, seq));
+                return true;
+            }
+            break;
         default:
             break;
     }
@@ -230,86 +839,895 @@ Server::ClientData *Server::getClientByTunnelIp(uint32_t ip)
     return &*it->second;
 }
 
-Server::ClientData *Server::getClientByRealIp(uint32_t ip)
+Server::ClientData *Server::getClient(const TunnelHeader &header, int dataLength, uint32_t realIp)
 {
-    ClientIpMap::iterator it = clientRealIpMap.find(ip);
-    if (it == clientRealIpMap.end())
+    uint32_t sessionId;
+    if (receivedOptions.get(TunnelHeader::FLAG_SESSION, sessionId))
+    {
+        ClientData *client = sessionSlots[sessionId & 0xff];
+        if (client == NULL || client->sessionId != sessionId)
+            return NULL;
+
+        uint32_t timestamp;
+        if (client->realIp == realIp)
+        {
+            // a connection request resets the session, only its owner may
+            // do that. others get a session of their own.
+            if (header.type == TunnelHeader::TYPE_CONNECTION_REQUEST)
+                return checkSessionAuth(client, header.type, dataLength, 0) ? client : NULL;
+
+            if (receivedOptions.get(TunnelHeader::FLAG_TIMESTAMP, timestamp) &&
+                (int32_t)(timestamp - client->lastTimestamp) > 0)
+                client->lastTimestamp = timestamp;
+            return client;
+        }
+
+        // further addresses are checked by handleEchoData
+        if (client->capabilities & CAPABILITY_MULTIPATH)
+            return client;
+
+        return migrateClient(client, header.type, dataLength, realIp) ? client : NULL;
+    }
+
+    // another client behind the same address is starting a session,
+    // this must not be taken for a reconnect of the client known there
+    ProtocolInfo info;
+    if (header.type == TunnelHeader::TYPE_CONNECTION_REQUEST &&
+        readProtocolInfo(echoReceivePayloadBuffer() + sizeof(ClientConnectData),
+                         dataLength - sizeof(ClientConnectData), info) &&
+        (info.capabilities & localCapabilities & CAPABILITY_SESSION_ID))
+        return NULL;
+    if (header.type == TunnelHeader::TYPE_CHALLENGE_RESPONSE && dataLength > sizeof(Auth::Response))
+        return NULL;
+    if (header.type == TunnelHeader::TYPE_RESUME)
         return NULL;
 
-    return &*it->second;
+    return getClientByRealIp(realIp);
 }
 
-void Server::handleTunData(int dataLength, uint32_t, uint32_t destIp)
+bool Server::checkSessionAuth(ClientData *client, uint8_t type, int dataLength, int replayWindow)
 {
-    if (destIp == network + 255) // ignore broadcasts
-        return;
+    uint32_t timestamp, sessionAuth;
+    if (!receivedOptions.get(TunnelHeader::FLAG_TIMESTAMP, timestamp) ||
+        !receivedOptions.get(TunnelHeader::FLAG_SESSION_AUTH, sessionAuth))
+        return false;
 
-    ClientData *client = getClientByTunnelIp(destIp);
+    uint32_t sequence = 0;
+    receivedOptions.get(TunnelHeader::FLAG_SEQUENCE, sequence);
 
-    if (client == NULL)
-    {
-        syslog(LOG_DEBUG, "data received for unknown client %s\n",
-               Utility::formatIp(destIp).data());
-        return;
-    }
+    if ((int32_t)(timestamp - client->lastTimestamp) <= -replayWindow ||
+        getSessionAuth(client->sessionKey, client->sessionId, timestamp, sequence, type,
+                       echoReceivePayloadBuffer(), dataLength) != sessionAuth)
+        return false;
+
+    if ((int32_t)(timestamp - client->lastTimestamp) > 0)
+        client->lastTimestamp = timestamp;
 
-    sendEchoToClient(client, TunnelHeader::TYPE_DATA, dataLength);
+    return true;
 }
 
-void Server::pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq)
+bool Server::checkPathSequence(ClientData *client, uint8_t type)
 {
-    unsigned int maxSavedPolls = client->maxPolls != 0 ? client->maxPolls : 1;
+    // the timestamps of several paths interleave, so a recorded packet is
+    // only told apart by its sequence number, which the mac covers
+    uint32_t sequence;
+    if (!receivedOptions.get(TunnelHeader::FLAG_SEQUENCE, sequence))
+        return false;
 
-    client->pollIds.push(ClientData::EchoId(echoId, echoSeq));
-    if (client->pollIds.size() > maxSavedPolls)
-        client->pollIds.pop();
-    DEBUG_ONLY(cout << "poll -> " << client->pollIds.size() << endl);
+    if (type == TunnelHeader::TYPE_DATA)
+        return client->dataReplay.check(sequence);
+    return client->requestReplay.check(sequence);
+}
 
-    if (client->pendingPackets.size() > 0)
-    {
-        Packet &packet = client->pendingPackets.front();
-        memcpy(echoSendPayloadBuffer(), &packet.data[0], packet.data.size());
-        client->pendingPackets.pop();
+bool Server::migrateClient(ClientData *client, uint8_t type, int dataLength, uint32_t realIp)
+{
+    // the mac is checked for admitted sources only, the timestamp has to be
+    // newer than anything seen before, so recorded packets cannot be replayed
+    if (!admission.admit(realIp, now) || !checkSessionAuth(client, type, dataLength, 0))
+        return false;
+
+    syslog(LOG_INFO, "client with tunnel ip %s moved from %s to %s",
+           Utility::formatIp(client->tunnelIp).data(),
+           Utility::formatIp(client->realIp).data(),
+           Utility::formatIp(realIp).data());
+
+    // polls from the old address cannot be answered anymore
+    clearPollIds(client);
+    client->realIp = realIp;
+
+    return true;
+}
 
-        DEBUG_ONLY(cout << "pending packet: " << packet.data.size() << " bytes\n");
-        sendEchoToClient(client, packet.type, packet.data.size());
+bool Server::usesAddress(ClientData *client, uint32_t realIp)
+{
+    if (client->realIp == realIp)
+        return true;
+
+    for (int i = 0; i < client->paths.size(); i++)
+        if (client->paths[i] == realIp)
+            return true;
+
+    return false;
+}
+
+void Server::handleNewPath(ClientData *client, uint8_t type, int dataLength, uint32_t realIp,
+                           uint16_t echoId, uint16_t echoSeq)
+{
+    if (!admission.admit(realIp, now))
+        return;
+
+    // what the client sent does arrive, the client would take it for loss
+    if (type == TunnelHeader::TYPE_PATH_CHALLENGE)
+    {
+        if (addPath(client, dataLength, realIp))
+            client->receivedRequests++;
+        return;
     }
 
-    client->lastActivity = now;
+    // a recorded packet sent from another address is dropped, a new one
+    // gets a challenge only the client can answer, and only if the address
+    // is the client's, the client does not count it either
+    if (!checkSessionAuth(client, type, dataLength, PATH_REPLAY_WINDOW) || !checkPathSequence(client, type))
+        return;
+
+    PathChallenge challenge;
+    challenge.timeBucket = htonl(cookieTimeBucket());
+    challenge.sessionId = htonl(client->sessionId);
+    Auth::Response mac = getPathChallengeMac(realIp, challenge);
+    memcpy(challenge.mac, &mac, sizeof(Auth::Response));
+
+    syslog(LOG_DEBUG, "challenging new path of %s from %s",
+           Utility::formatIp(client->tunnelIp).data(), Utility::formatIp(realIp).data());
+
+    memcpy(echoSendPayloadBuffer(), &challenge, sizeof(PathChallenge));
+    sendEcho(magic, TunnelHeader::TYPE_PATH_CHALLENGE, sizeof(PathChallenge), realIp, receivedLocalIp,
+             true, echoId, echoSeq, true);
 }
 
-void Server::sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength)
+Auth::Response Server::getPathChallengeMac(uint32_t realIp, const PathChallenge &challenge)
 {
-    if (client->maxPolls == 0)
+    uint32_t data[3] = { htonl(realIp), challenge.timeBucket, challenge.sessionId };
+    return Auth::getMac(cookieSecret, (const char *)data, sizeof(data));
+}
+
+bool Server::addPath(ClientData *client, int dataLength, uint32_t realIp)
+{
+    if (dataLength != sizeof(PathChallenge) + sizeof(Auth::Response))
+        return false;
+
+    PathChallenge challenge;
+    memcpy(&challenge, echoReceivePayloadBuffer(), sizeof(PathChallenge));
+
+    // the challenge has to be one of ours, sent to this address, and the
+    // client's mac proves it got there
+    uint32_t bucket = ntohl(challenge.timeBucket);
+    uint32_t currentBucket = cookieTimeBucket();
+    Auth::Response serverMac = getPathChallengeMac(realIp, challenge);
+    Auth::Response clientMac = Auth::getMac(client->sessionKey, echoReceivePayloadBuffer(), sizeof(PathChallenge));
+
+    if ((bucket != currentBucket && bucket + 1 != currentBucket) ||
+        ntohl(challenge.sessionId) != client->sessionId ||
+        memcmp(challenge.mac, &serverMac, sizeof(Auth::Response)) != 0 ||
+        memcmp(echoReceivePayloadBuffer() + sizeof(PathChallenge), &clientMac, sizeof(Auth::Response)) != 0)
     {
-        sendEcho(magic, type, dataLength, client->realIp, true, client->pollIds.front().id, client->pollIds.front().seq);
+        syslog(LOG_DEBUG, "invalid path challenge response from %s", Utility::formatIp(realIp).data());
+        return false;
+    }
+
+    // the oldest address is most likely the one that went away
+    if (client->paths.size() == MAX_PATHS - 1)
+        client->paths.erase(client->paths.begin());
+    client->paths.push_back(realIp);
+
+    syslog(LOG_INFO, "client with tunnel ip %s added path from %s",
+           Utility::formatIp(client->tunnelIp).data(),
+           Utility::formatIp(realIp).data());
+
+    return true;
+}
+
+Server::ClientData::PathCounters &Server::getPathCounters(ClientData *client, uint32_t realIp, uint32_t localIp)
+{
+    vector<ClientData::PathCounters> &counters = client->pathCounters;
+    for (int i = 0; i < counters.size(); i++)
+        if (counters[i].realIp == realIp && counters[i].localIp == localIp)
+            return counters[i];
+
+    if (counters.size() == MAX_PATHS)
+        counters.erase(counters.begin());
+
+    ClientData::PathCounters path;
+    path.realIp = realIp;
+    path.localIp = localIp;
+    path.receivedRequests = 0;
+    path.sentReplies = 0;
+    counters.push_back(path);
+
+    return counters.back();
+}
+
+Server::ClientData *Server::getClientByRealIp(uint32_t ip)
+{
+    ClientIpMap::iterator it = clientRealIpMap.find(ip);
+    if (it == clientRealIpMap.end())
+        return NULL;
+
+    return &*it->second;
+}
+
+void Server::handleTunData(int dataLength, uint32_t, uint32_t destIp)
+{
+    if (destIp == network + 255) // ignore broadcasts
+        return;
+
+    ClientData *client = getClientByTunnelIp(destIp);
+
+    // the client is about to come back, it gets the packet once it is accepted
+    if (client == NULL || client->state != ClientData::STATE_ESTABLISHED)
+    {
+        if (!holdPacket(destIp, dataLength, client))
+            syslog(LOG_DEBUG, "data received for unknown client %s\n",
+                   Utility::formatIp(destIp).data());
         return;
     }
 
-    if (client->pollIds.size() != 0)
+    sendDataToClient(client, dataLength);
+}
+
+int Server::clientEchoSize(ClientData *client)
+{
+    int size = client->mtu != 0 ? client->mtu : maxEchoSize();
+
+    // the path may have shrunk since the client probed it, data might take
+    // any of the client's paths
+    for (int i = -1; i < (int)client->paths.size(); i++)
     {
-        ClientData::EchoId echoId = client->pollIds.front();
-        client->pollIds.pop();
+        PathMtuMap::iterator it = pathMtus.find(i < 0 ? client->realIp : client->paths[i]);
+        if (it != pathMtus.end() && now < it->second.expiry && it->second.mtu < size)
+            size = it->second.mtu;
+    }
+
+    return size;
+}
+
+void Server::handlePacketTooBig(uint32_t realIp, int mtu)
+{
+    // forged errors could make us send tiny fragments
+    if (mtu < PMTU_MIN_SIZE)
+        mtu = PMTU_MIN_SIZE;
+
+    // errors only matter for addresses of clients, anything else would let
+    // the cache grow without bounds
+    bool known = false;
+    for (ClientList::iterator it = clientList.begin(); it != clientList.end() && !known; ++it)
+        known = usesAddress(&*it, realIp);
+    if (!known)
+        return;
+
+    PathMtu &pathMtu = pathMtus[realIp];
+    if (pathMtu.mtu != mtu)
+        syslog(LOG_DEBUG, "path mtu to %s dropped to %d bytes",
+               Utility::formatIp(realIp).data(), mtu);
+
+    pathMtu.mtu = mtu;
+    pathMtu.expiry = now + PMTU_CACHE_LIFETIME;
+}
+
+void Server::sendDataToClient(ClientData *client, int dataLength)
+{
+    // the tunnel mtu fits the best path, packets for clients behind a
+    // smaller one are handled like a router would
+    int maxLength = mtuProbeLength(clientEchoSize(client));
+    if (dataLength <= maxLength)
+    {
+        sendEchoToClient(client, TunnelHeader::TYPE_DATA, dataLength);
+        return;
+    }
+
+    const IpHeader *header = (const IpHeader *)echoSendPayloadBuffer();
+    if (dataLength < (int)sizeof(IpHeader) || header->ip_v != 4)
+        return;
 
-        DEBUG_ONLY(cout << "sending -> " << client->pollIds.size() << endl);
-        sendEcho(magic, type, dataLength, client->realIp, true, echoId.id, echoId.seq);
+    if (ntohs(header->ip_off) & IP_DF)
+        sendFragmentationNeeded(dataLength, maxLength);
+    else
+        sendFragments(client, dataLength, maxLength);
+}
+
+void Server::sendFragments(ClientData *client, int dataLength, int maxLength)
+{
+    vector<char> packet(echoSendPayloadBuffer(), echoSendPayloadBuffer() + dataLength);
+    const IpHeader *header = (const IpHeader *)&packet[0];
+
+    int headerLength = header->ip_hl * 4;
+    int fragmentSize = (maxLength - headerLength) & ~7;
+    if (headerLength < (int)sizeof(IpHeader) || headerLength > dataLength || fragmentSize <= 0)
+        return;
+
+    DEBUG_ONLY(cout << "fragmenting " << dataLength << " bytes for "
+                    << Utility::formatIp(client->tunnelIp) << endl);
+
+    // the packet might be a fragment itself, its offset and more fragments
+    // flag carry over
+    int offset = ntohs(header->ip_off) & IP_OFFMASK;
+    bool moreFragments = ntohs(header->ip_off) & IP_MF;
+
+    for (int position = headerLength; position < dataLength; position += fragmentSize)
+    {
+        int length = dataLength - position < fragmentSize ? dataLength - position : fragmentSize;
+        bool last = position + length == dataLength;
+
+        char *fragment = echoSendPayloadBuffer();
+        memcpy(fragment, &packet[0], headerLength);
+        memcpy(fragment + headerLength, &packet[position], length);
+
+        IpHeader *fragmentHeader = (IpHeader *)fragment;
+        fragmentHeader->ip_len = htons(headerLength + length);
+        fragmentHeader->ip_off = htons((offset + (position - headerLength) / 8) |
+                                       (!last || moreFragments ? IP_MF : 0));
+        fragmentHeader->ip_sum = 0;
+        fragmentHeader->ip_sum = Utility::checksum(fragment, headerLength);
+
+        sendEchoToClient(client, TunnelHeader::TYPE_DATA, headerLength + length);
+    }
+}
+
+void Server::sendFragmentationNeeded(int dataLength, int mtu)
+{
+    const IpHeader *header = (const IpHeader *)echoSendPayloadBuffer();
+    int headerLength = header->ip_hl * 4;
+    if (headerLength < (int)sizeof(IpHeader) || headerLength > dataLength)
+        return;
+
+    // the original header and the first 8 bytes of its payload
+    int quoteLength = headerLength + 8 < dataLength ? headerLength + 8 : dataLength;
+    int length = sizeof(IpHeader) + 8 + quoteLength;
+
+    vector<char> packet(length);
+    IpHeader *reply = (IpHeader *)&packet[0];
+    reply->ip_v = 4;
+    reply->ip_hl = sizeof(IpHeader) / 4;
+    reply->ip_tos = 0;
+    reply->ip_len = htons(length);
+    reply->ip_id = 0;
+    reply->ip_off = 0;
+    reply->ip_ttl = 64;
+    reply->ip_p = IPPROTO_ICMP;
+    // our own address would be dropped as a martian, the client is the
+    // hop with the smaller mtu anyway
+    reply->ip_src = header->ip_dst;
+    reply->ip_dst = header->ip_src;
+    reply->ip_sum = Utility::checksum(&packet[0], sizeof(IpHeader));
+
+    // destination unreachable, fragmentation needed, with the next hop mtu
+    char *icmp = &packet[sizeof(IpHeader)];
+    icmp[0] = 3;
+    icmp[1] = 4;
+    *(uint16_t *)(icmp + 6) = htons(mtu);
+    memcpy(icmp + 8, header, quoteLength);
+    *(uint16_t *)(icmp + 2) = Utility::checksum(icmp, 8 + quoteLength);
+
+    tun.write(&packet[0], length);
+}
+
+void Server::handleDataFromClient(ClientData *client, int dataLength)
+{
+    if (dataLength == 0)
+    {
+        syslog(LOG_WARNING, "received empty data packet");
+        return;
+    }
+
+    uint32_t sequence;
+    if (!receivedOptions.get(TunnelHeader::FLAG_SEQUENCE, sequence))
+    {
+        sendToTun(dataLength);
+        return;
+    }
+
+    if (client->reorder.add(sequence, echoReceivePayloadBuffer(), dataLength, now))
+        sendToTun(dataLength);
+
+    deliverReordered(client);
+    updateTimeout(client);
+}
+
+void Server::deliverReordered(ClientData *client)
+{
+    vector<char> data;
+    while (client->reorder.next(data, now))
+        tun.write(&data[0], data.size());
+}
+
+Server::ClientData::EchoId Server::receivedEchoId(uint32_t realIp, uint16_t echoId, uint16_t echoSeq)
+{
+    ClientData::EchoId id(echoId, echoSeq);
+    id.realIp = realIp;
+    id.localIp = receivedLocalIp;
+    id.hasTimestamp = receivedOptions.get(TunnelHeader::FLAG_TIMESTAMP, id.timestamp);
+    id.received = receivedTime;
+    id.tracked = false;
+    return id;
+}
+
+void Server::pollReceived(ClientData *client, uint32_t realIp, uint16_t echoId, uint16_t echoSeq,
+                          bool modeProbe)
+{
+    // clients that probe the path turn polling off with a window of 0 when
+    // replies get through without it, and on again
+    bool switchable = client->maxPollWindow != 0 && (client->capabilities & CAPABILITY_MODE_PROBE);
+
+    uint32_t window;
+    if ((client->maxPolls != 0 || switchable) && receivedOptions.get(TunnelHeader::FLAG_POLL_WINDOW, window))
+    {
+        if (window == 0 && switchable)
+            client->maxPolls = 0;
+        else
+            client->maxPolls = window < 1 ? 1 : window < client->maxPollWindow ? window : client->maxPollWindow;
+    }
+
+    client->lastActivity = now;
+
+    // without polling the latest request is the one answered, probes
+    // included, as they are all the client sends while idle
+    if (modeProbe && client->maxPolls != 0)
+        return;
+
+    unsigned int maxSavedPolls = client->maxPolls != 0 ? client->maxPolls : 1;
+
+    ClientData::EchoId id = receivedEchoId(realIp, echoId, echoSeq);
+    storePollId(client, id);
+    while (client->pollIds.size() > maxSavedPolls)
+        dropOldestPollId(client);
+    DEBUG_ONLY(cout << "poll -> " << client->pollIds.size() << endl);
+
+    if (!client->pendingPackets.empty())
+        serveClient(client);
+
+    // the first stored id has to be refreshed before it expires
+    updateTimeout(client);
+}
+
+void Server::sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength,
+                              const ClientData::EchoId &echoId)
+{
+    HeaderOptions options;
+
+    if (client->capabilities & CAPABILITY_ADAPTIVE_POLLING)
+    {
+        // the time we held the poll is added, so the client sees the round
+        // trip time of the path only
+        if (echoId.hasTimestamp)
+            options.set(TunnelHeader::FLAG_TIMESTAMP,
+                        echoId.timestamp + (now - echoId.received).getMilliseconds());
+
+        uint32_t pending = client->pendingPackets.size() < 0xffff ? client->pendingPackets.size() : 0xffff;
+        uint32_t stored = client->pollIds.size() < 0xffff ? client->pollIds.size() : 0xffff;
+        options.set(TunnelHeader::FLAG_POLL_STATUS, pending << 16 | stored);
+    }
+
+    // lets the client see how many of its echoes get lost on the way
+    client->sentReplies++;
+    if (client->capabilities & CAPABILITY_PACING)
+        options.set(TunnelHeader::FLAG_COUNTERS,
+                    (uint32_t)client->receivedRequests << 16 | client->sentReplies);
+
+    if (client->capabilities & CAPABILITY_MULTIPATH)
+    {
+        ClientData::PathCounters &path = getPathCounters(client, echoId.realIp, echoId.localIp);
+        path.sentReplies++;
+        options.set(TunnelHeader::FLAG_PATH_COUNTERS,
+                    (uint32_t)path.receivedRequests << 16 | path.sentReplies);
+
+        // data striped over several paths is put back in order by the client,
+        // as long as there is one path only it arrives in order anyway
+        if (type == TunnelHeader::TYPE_DATA && !client->paths.empty())
+            options.set(TunnelHeader::FLAG_SEQUENCE, client->sentSequence++);
+    }
+
+    sendEcho(magic, type, dataLength, echoId.realIp, echoId.localIp, true, echoId.id, echoId.seq,
+             client->capabilities & CAPABILITY_EXTENDED_HEADER, options);
+}
+
+void Server::sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength)
+{
+    // control packets are not shaped, the client might be gone before the
+    // shaper lets them through
+    bool shaped = type == TunnelHeader::TYPE_DATA;
+
+    if (client->pendingPackets.empty() && client->pollIds.size() != 0 &&
+        (!shaped || consumeTokens(client, dataLength)))
+    {
+        sendEchoToClient(client, type, dataLength, takePollId(client));
         return;
     }
 
     if (client->pendingPackets.size() == MAX_BUFFERED_PACKETS)
     {
-        client->pendingPackets.pop();
+        client->pendingPackets.dropLowest();
+        queueDrops++;
         syslog(LOG_WARNING, "packet to %s dropped",
                Utility::formatIp(client->tunnelIp).data());
     }
 
-    DEBUG_ONLY(cout << "packet queued: " << dataLength << " bytes\n");
+    // control packets go first, the client waits for them
+    PacketQueue::Class packetClass = shaped ?
+        PacketQueue::classify(echoSendPayloadBuffer(), dataLength) : PacketQueue::CLASS_INTERACTIVE;
+
+    DEBUG_ONLY(cout << "packet queued: " << dataLength << " bytes, class " << packetClass << endl);
 
-    client->pendingPackets.push(Packet());
-    Packet &packet = client->pendingPackets.back();
+    Packet packet;
     packet.type = type;
-    packet.data.resize(dataLength);
-    memcpy(&packet.data[0], echoReceivePayloadBuffer(), dataLength);
+    packet.data.assign(echoSendPayloadBuffer(), echoSendPayloadBuffer() + dataLength);
+    client->pendingPackets.push(packet, packetClass);
+
+    serveClient(client);
+    updateTimeout(client);
+}
+
+void Server::storePollId(ClientData *client, ClientData::EchoId &echoId)
+{
+    echoId.tracked = false;
+    for (int i = 0; i < client->pollStreams.size() && !echoId.tracked; i++)
+    {
+        if (client->pollStreams[i].id == echoId.id)
+        {
+            client->pollStreams[i].polls++;
+            echoId.tracked = true;
+        }
+    }
+
+    // a new id has not been answered yet, so it goes first
+    if (!echoId.tracked && client->pollStreams.size() < MAX_ECHO_STREAMS)
+    {
+        ClientData::PollStream stream;
+        stream.id = echoId.id;
+        stream.polls = 1;
+        client->pollStreams.insert(client->pollStreams.begin(), stream);
+        echoId.tracked = true;
+    }
+
+    if (!echoId.tracked)
+        client->untrackedPolls++;
+
+    client->pollIds.push_back(echoId);
+}
+
+void Server::releasePollId(ClientData *client, const ClientData::EchoId &echoId)
+{
+    if (!echoId.tracked)
+    {
+        client->untrackedPolls--;
+        return;
+    }
+
+    for (int i = 0; i < client->pollStreams.size(); i++)
+    {
+        if (client->pollStreams[i].id == echoId.id)
+        {
+            if (--client->pollStreams[i].polls == 0)
+                client->pollStreams.erase(client->pollStreams.begin() + i);
+            return;
+        }
+    }
+}
+
+void Server::dropOldestPollId(ClientData *client)
+{
+    releasePollId(client, client->pollIds.front());
+    client->pollIds.pop_front();
+}
+
+void Server::clearPollIds(ClientData *client)
+{
+    client->pollIds.clear();
+    client->pollStreams.clear();
+    client->untrackedPolls = 0;
+}
+
+Server::ClientData::EchoId Server::takePollId(ClientData *client)
+{
+    // the freshest id is the most likely to still pass firewalls and NATs,
+    // without polling the latest request is answered again and again
+    std::deque<ClientData::EchoId>::iterator it = client->pollIds.end() - 1;
+
+    // a client polling with several ids at once gets its replies on them in
+    // turn. with -i every poll has an id of its own, the newest one comes
+    // first and beyond MAX_ECHO_STREAMS ids the order is left as it is.
+    if (client->pollStreams.size() > 1 && client->untrackedPolls == 0)
+    {
+        ClientData::PollStream stream = client->pollStreams.front();
+        while (it->id != stream.id)
+            --it;
+
+        if (stream.polls > 1)
+        {
+            client->pollStreams.erase(client->pollStreams.begin());
+            client->pollStreams.push_back(stream);
+        }
+    }
+
+    ClientData::EchoId echoId = *it;
+
+    if (client->maxPolls != 0)
+    {
+        releasePollId(client, echoId);
+        client->pollIds.erase(it);
+    }
+    client->usedPolls++;
+
+    DEBUG_ONLY(cout << "sending -> " << client->pollIds.size() << endl);
+    return echoId;
+}
+
+void Server::setPollTimeout(ClientData *client, int dataLength)
+{
+    // idle clients ask for their polls to be held until just before
+    // middleboxes forget the id, polls without a time go back to ours
+    int timeout = 0;
+    if (dataLength >= sizeof(uint32_t))
+        timeout = ntohl(*(const uint32_t *)echoReceivePayloadBuffer());
+
+    if (timeout < pollTimeout.getMilliseconds())
+        timeout = pollTimeout.getMilliseconds();
+    if (timeout > IDLE_MAX_KEEPALIVE)
+        timeout = IDLE_MAX_KEEPALIVE;
+
+    if (timeout == client->pollTimeout.getMilliseconds())
+        return;
+
+    bool shorter = timeout < client->pollTimeout.getMilliseconds();
+    client->pollTimeout = timeout;
+    if (shorter)
+        updateTimeout(client);
+}
+
+void Server::agePollIds(ClientData *client)
+{
+    // without polling the only id is the latest request, which is kept
+    if (client->maxPolls == 0 || client->state != ClientData::STATE_ESTABLISHED)
+        return;
+
+    while (!client->pollIds.empty() && !(now < client->pollIds.front().received + client->pollTimeout))
+    {
+        ClientData::EchoId echoId = client->pollIds.front();
+        dropOldestPollId(client);
+
+        // clients that know about refreshes replace the id with a new one,
+        // older ones send a poll every POLL_INTERVAL anyway
+        if (client->capabilities & CAPABILITY_POLL_REFRESH)
+        {
+            sendEchoToClient(client, TunnelHeader::TYPE_POLL, 0, echoId);
+            client->refreshedPolls++;
+        }
+        else
+        {
+            client->expiredPolls++;
+        }
+    }
+}
+
+void Server::logPollStats(ClientData *client)
+{
+    int total = client->usedPolls + client->refreshedPolls + client->expiredPolls;
+    if (total == 0)
+        return;
+
+    syslog(LOG_DEBUG, "poll ids of %s: %d used, %d refreshed, %d expired, hit rate %d%%",
+           Utility::formatIp(client->realIp).data(), client->usedPolls,
+           client->refreshedPolls, client->expiredPolls, client->usedPolls * 100 / total);
+
+    client->usedPolls = 0;
+    client->refreshedPolls = 0;
+    client->expiredPolls = 0;
+}
+
+void Server::logAdmissionStats()
+{
+    const Admission::Stats &stats = admission.getStats();
+
+    if (stats.sourceLimited != 0 || stats.globalLimited != 0)
+        syslog(LOG_INFO, "admission: %d requests admitted, %d limited per source, %d limited in total, %d sources evicted",
+               stats.admitted, stats.sourceLimited, stats.globalLimited, stats.evicted);
+
+    admission.resetStats();
+}
+
+void Server::holdPackets(ClientData *client)
+{
+    HeldPackets &held = heldPackets[client->tunnelIp];
+    if (!held.packets.empty() && !heldFor(client, held))
+        held.packets = std::queue<Packet>();
+    held.expiry = now + HOLD_TIME;
+    held.sessionId = client->sessionId;
+    held.realIp = client->realIp;
+
+    while (!client->pendingPackets.empty())
+    {
+        Packet &packet = client->pendingPackets.front();
+        if (packet.type == TunnelHeader::TYPE_DATA && held.packets.size() < MAX_BUFFERED_PACKETS)
+            held.packets.push(packet);
+        client->pendingPackets.pop();
+    }
+}
+
+bool Server::holdPacket(uint32_t tunnelIp, int dataLength, ClientData *connecting)
+{
+    HeldPacketMap::iterator it = heldPackets.find(tunnelIp);
+
+    if (it != heldPackets.end() && it->second.expiry < now)
+    {
+        heldPackets.erase(it);
+        it = heldPackets.end();
+    }
+
+    if (it == heldPackets.end())
+    {
+        if (connecting == NULL)
+            return false;
+
+        it = heldPackets.insert(std::make_pair(tunnelIp, HeldPackets())).first;
+        it->second.expiry = now + HOLD_TIME;
+        it->second.sessionId = connecting->sessionId;
+        it->second.realIp = connecting->realIp;
+    }
+
+    std::queue<Packet> &packets = it->second.packets;
+    if (packets.size() == MAX_BUFFERED_PACKETS)
+        packets.pop();
+
+    packets.push(Packet());
+    packets.back().type = TunnelHeader::TYPE_DATA;
+    packets.back().data.assign(echoSendPayloadBuffer(), echoSendPayloadBuffer() + dataLength);
+
+    return true;
+}
+
+void Server::releaseHeldPackets(ClientData *client)
+{
+    HeldPacketMap::iterator it = heldPackets.find(client->tunnelIp);
+    if (it == heldPackets.end())
+        return;
+
+    // the tunnel ip may have gone to another client in the meantime
+    std::queue<Packet> packets;
+    if (!(it->second.expiry < now) && heldFor(client, it->second))
+        packets = it->second.packets;
+    heldPackets.erase(it);
+
+    DEBUG_ONLY(cout << "releasing " << packets.size() << " held packets" << endl);
+
+    while (!packets.empty())
+    {
+        Packet &packet = packets.front();
+        memcpy(echoSendPayloadBuffer(), &packet.data[0], packet.data.size());
+        sendDataToClient(client, packet.data.size());
+        packets.pop();
+    }
+}
+
+bool Server::heldFor(ClientData *client, const HeldPackets &held)
+{
+    // a resumed session keeps its id, a reconnecting client its address
+    return (held.sessionId != 0 && held.sessionId == client->sessionId) || held.realIp == client->realIp;
+}
+
+int Server::wireSize(int dataLength)
+{
+    return dataLength + headerSize() + Echo::headerSize();
+}
+
+bool Server::consumeTokens(ClientData *client, int dataLength)
+{
+    int size = wireSize(dataLength);
+
+    if (!client->shaper.available(now, size) || !egressShaper.available(now, size))
+        return false;
+
+    client->shaper.consume(now, size);
+    egressShaper.consume(now, size);
+    return true;
+}
+
+int Server::serveClient(ClientData *client, int maxPackets)
+{
+    int sent = 0;
+
+    while (sent != maxPackets && !client->pendingPackets.empty() && client->pollIds.size() != 0)
+    {
+        Packet &packet = client->pendingPackets.front();
+
+        if (packet.type == TunnelHeader::TYPE_DATA && !consumeTokens(client, packet.data.size()))
+            break;
+
+        memcpy(echoSendPayloadBuffer(), &packet.data[0], packet.data.size());
+        TunnelHeader::Type type = packet.type;
+        int dataLength = packet.data.size();
+        client->pendingPackets.pop();
+
+        DEBUG_ONLY(cout << "pending packet: " << dataLength << " bytes\n");
+        sendEchoToClient(client, type, dataLength, takePollId(client));
+        sent++;
+    }
+
+    return sent;
+}
+
+void Server::servePendingPackets()
+{
+    // one packet per client and round keeps the egress shaper fair
+    bool sent = true;
+    while (sent)
+    {
+        sent = false;
+
+        for (ClientList::iterator it = clientList.begin(); it != clientList.end(); ++it)
+            if (serveClient(&*it, 1) != 0)
+                sent = true;
+    }
+}
+
+void Server::updateTimeout()
+{
+    Time next = nextClientCheck;
+
+    // the load is sampled all the time, new clients only read it
+    if (loadThreshold != 0 && loadSampleTime + LOAD_SAMPLE_INTERVAL < next)
+        next = loadSampleTime + LOAD_SAMPLE_INTERVAL;
+
+    if (!deadlines.empty() && deadlines.begin()->first < next)
+        next = deadlines.begin()->first;
+
+    setTimeout(next - now);
+}
+
+void Server::updateTimeout(ClientData *client)
+{
+    // the temporary clients of a handshake are not in the list
+    if (client->tunnelIp == 0)
+        return;
+
+    Time next = Time::ZERO;
+
+    Time reorderTimeout = client->reorder.nextTimeout();
+    if (reorderTimeout != Time::ZERO)
+        next = reorderTimeout;
+
+    for (int i = 0; i < client->delayedProbes.size(); i++)
+        if (next == Time::ZERO || client->delayedProbes[i].due < next)
+            next = client->delayedProbes[i].due;
+
+    if (client->maxPolls != 0 && !client->pollIds.empty())
+    {
+        Time expiry = client->pollIds.front().received + client->pollTimeout;
+        if (next == Time::ZERO || expiry < next)
+            next = expiry;
+    }
+
+    // waiting for tokens of the egress shaper only ever gets longer through
+    // other clients, so their deadline at worst comes too early
+    if (!client->pendingPackets.empty() && client->pollIds.size() != 0)
+    {
+        int size = wireSize(client->pendingPackets.front().data.size());
+        Time clientWait = client->shaper.timeUntilAvailable(now, size);
+        Time egressWait = egressShaper.timeUntilAvailable(now, size);
+        Time release = now + (clientWait > egressWait ? clientWait : egressWait);
+
+        if (next == Time::ZERO || release < next)
+            next = release;
+    }
+
+    // only the client that changed is looked at, the timeout is the
+    // earliest deadline of all of them
+    if (next != client->deadline)
+    {
+        deadlines.erase(std::make_pair(client->deadline, client));
+        client->deadline = next;
+        if (next != Time::ZERO)
+            deadlines.insert(std::make_pair(next, client));
+    }
+
+    updateTimeout();
 }
 
 void Server::releaseTunnelIp(uint32_t tunnelIp)
@@ -319,20 +1737,71 @@ void Server::releaseTunnelIp(uint32_t tunnelIp)
 
 void Server::handleTimeout()
 {
-    ClientList::iterator it = clientList.begin();
-    while (it != clientList.end())
+    servePendingPackets();
+
+    if (loadThreshold != 0)
+        updateLoad();
+
+    for (ClientList::iterator it = clientList.begin(); it != clientList.end(); ++it)
     {
-        ClientData &client = *it++;
+        agePollIds(&*it);
+        deliverReordered(&*it);
+        sendDelayedProbes(&*it);
+        updateTimeout(&*it);
+    }
 
-        if (client.lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
+    if (nextClientCheck < now)
+    {
+        ClientList::iterator it = clientList.begin();
+        while (it != clientList.end())
         {
-            syslog(LOG_DEBUG, "client %s timed out\n",
-                   Utility::formatIp(client.realIp).data());
-            removeClient(&client);
+            ClientData &client = *it++;
+
+            logPollStats(&client);
+
+            if (client.lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
+            {
+                syslog(LOG_DEBUG, "client %s timed out\n",
+                       Utility::formatIp(client.realIp).data());
+                removeClient(&client);
+            }
         }
+
+        HeldPacketMap::iterator held = heldPackets.begin();
+        while (held != heldPackets.end())
+        {
+            if (held->second.expiry < now)
+                heldPackets.erase(held++);
+            else
+                ++held;
+        }
+
+        PathMtuMap::iterator pathMtu = pathMtus.begin();
+        while (pathMtu != pathMtus.end())
+        {
+            if (pathMtu->second.expiry < now)
+                pathMtus.erase(pathMtu++);
+            else
+                ++pathMtu;
+        }
+
+        logAdmissionStats();
+        nextClientCheck = now + KEEP_ALIVE_INTERVAL;
     }
 
-    setTimeout(KEEP_ALIVE_INTERVAL);
+    updateTimeout();
+}
+
+bool Server::tunnelIpAvailable(uint32_t desiredIp) const
+{
+    if (desiredIp > network + 1 && desiredIp < network + 255 && !usedIps.count(desiredIp))
+        return true;
+
+    for (int offset = FIRST_ASSIGNED_IP_OFFSET; offset < 255; offset++)
+        if (!usedIps.count(network + offset))
+            return true;
+
+    return false;
 }
 
 uint32_t Server::reserveTunnelIp(uint32_t desiredIp)
@@ -367,7 +1836,11 @@ uint32_t Server::reserveTunnelIp(uint32_t desiredIp)
 
 void Server::run()
 {
-    setTimeout(KEEP_ALIVE_INTERVAL);
+    now = Time::now();
+    nextClientCheck = now + KEEP_ALIVE_INTERVAL;
+    if (loadThreshold != 0)
+        updateLoad();
+    updateTimeout();
 
     Worker::run();
 }
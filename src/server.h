@@ -22,9 +22,15 @@
 
 #include "worker.h"
 #include "auth.h"
+#include "tokenbucket.h"
+#include "packetqueue.h"
+#include "admission.h"
+#include "reorderbuffer.h"
+#include "replaywindow.h"
 
 #include <map>
 #include <queue>
+#include <deque>
 #include <vector>
 #include <list>
 #include <set>
@@ -34,24 +40,42 @@ class Server : public Worker
 {
 public:
     Server(int tunnelMtu, const std::string *deviceName, const std::string &passphrase,
-           uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout);
+           uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout,
+           int clientRate, int clientBurst, int egressRate, // bytes per second, 0 for unlimited
+           const std::vector<uint32_t> &peers, int loadThreshold, // percent, 0 to redirect only when full
+           int socketBufferSize); // bytes, 0 to grow as needed
     virtual ~Server();
 
     struct ClientConnectData
     {
         uint8_t maxPolls;
         uint32_t desiredIp;
-    };
+    }; // followed by ProtocolInfo from protocol version 2 on
 
-    static const TunnelHeader::Magic magic;
+    // handed out with the accept, lets the client skip the handshake when
+    // it reconnects, opaque to the client
+    struct ResumptionTicket
+    {
+        uint32_t issued; // seconds
+        uint32_t tunnelIp;
+        uint32_t sessionId;
+        uint16_t maxPolls;
+        uint8_t version;
+        uint8_t reserved;
+        uint32_t capabilities;
+    }; // size = 20, network byte order, followed by a mac
 
-protected:
-    struct Packet
+    // payload of TYPE_RESUME: the ticket with its mac, the client's
+    // timestamp and a mac of both keyed with the ticket's session key
+    enum
     {
-        TunnelHeader::Type type;
-        std::vector<char> data;
+        TICKET_SIZE = sizeof(ResumptionTicket) + sizeof(Auth::Response),
+        RESUME_SIZE = TICKET_SIZE + sizeof(uint32_t) + sizeof(Auth::Response)
     };
 
+    static const TunnelHeader::Magic magic;
+
+protected:
     struct ClientData
     {
         enum State
@@ -67,61 +91,245 @@ protected:
 
             uint16_t id;
             uint16_t seq;
+
+            // the reply goes back the way the request came
+            uint32_t realIp;
+            uint32_t localIp;
+
+            bool hasTimestamp;
+            uint32_t timestamp;
+            Time received;
+
+            bool tracked; // counted in pollStreams
+        };
+
+        // echo ids the client polls with, least recently answered first
+        struct PollStream
+        {
+            uint16_t id;
+            int polls;
         };
 
         uint32_t realIp;
         uint32_t tunnelIp;
+        uint32_t sessionId; // random << 8 | last byte of the tunnel ip, 0 if none
+        Auth::Challenge sessionKey;
+        uint32_t lastTimestamp; // of the latest packet from realIp
+        std::vector<uint32_t> paths; // further addresses of a multipath session
 
-        std::queue<Packet> pendingPackets;
+        PacketQueue pendingPackets;
 
         int maxPolls;
-        std::queue<EchoId> pollIds;
+        int maxPollWindow;
+        std::deque<EchoId> pollIds; // oldest first
+        Time pollTimeout; // raised by idle clients
+        std::vector<PollStream> pollStreams;
+        int untrackedPolls; // with more than MAX_ECHO_STREAMS ids
         Time lastActivity;
+        Time deadline; // of its earliest timer, ZERO if none runs
+
+        int usedPolls;
+        int refreshedPolls;
+        int expiredPolls;
+
+        uint16_t receivedRequests;
+        uint16_t sentReplies;
+
+        int mtu; // echo size reported by the client, 0 if unknown, limits the data sent
+
+        // the unsolicited replies mode probes asked for
+        struct DelayedProbe
+        {
+            DelayedProbe(const EchoId &echoId) : echoId(echoId) { }
+
+            EchoId echoId;
+            Time due;
+            ModeProbe probe;
+        };
+
+        std::vector<DelayedProbe> delayedProbes;
+
+        uint16_t sentSequence; // of data to multipath clients
+        ReorderBuffer reorder; // data from multipath clients
+        ReplayWindow dataReplay; // of data arriving on further paths
+        ReplayWindow requestReplay; // of everything else arriving on further paths
+
+        // lets multipath clients tell the loss of each path apart
+        struct PathCounters
+        {
+            uint32_t realIp;
+            uint32_t localIp;
+            uint16_t receivedRequests;
+            uint16_t sentReplies;
+        };
+
+        std::vector<PathCounters> pathCounters;
+
+        TokenBucket shaper;
 
         State state;
 
+        uint8_t version;
+        uint32_t capabilities;
+        int redirects; // followed by the client before it came to us
+        Auth::Challenge redirectNonce; // empty if the client cannot check redirects
+
         Auth::Challenge challenge;
     };
 
     typedef std::list<ClientData> ClientList;
     typedef std::map<uint32_t, ClientList::iterator> ClientIpMap;
+    typedef std::set<std::pair<Time, ClientData *> > DeadlineSet;
+
+    // data for clients in the middle of a handshake or a reconnect
+    struct HeldPackets
+    {
+        Time expiry;
+        uint32_t sessionId; // of the session they are kept for
+        uint32_t realIp;
+        std::queue<Packet> packets;
+    };
+
+    typedef std::map<uint32_t, HeldPackets> HeldPacketMap; // by tunnel ip
+
+    // learned from icmp errors for echoes we sent
+    struct PathMtu
+    {
+        int mtu;
+        Time expiry;
+    };
+
+    typedef std::map<uint32_t, PathMtu> PathMtuMap; // by real ip
 
     virtual bool handleEchoData(const TunnelHeader &header, int dataLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
     virtual void handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp);
     virtual void handleTimeout();
+    virtual void handlePacketTooBig(uint32_t realIp, int mtu);
 
     virtual void run();
 
     void serveTun(ClientData *client);
 
     void handleUnknownClient(const TunnelHeader &header, int dataLength, uint32_t realIp, uint16_t echoId, uint16_t echoSeq);
+    bool readConnectData(ClientData *client, const char *data, int length, uint32_t &desiredIp);
+    ClientData *addClient(const ClientData &client, uint32_t sessionId = 0);
     void removeClient(ClientData *client);
 
     void sendChallenge(ClientData *client);
     void checkChallenge(ClientData *client, int dataLength);
+    void acceptClient(ClientData *client);
+    bool acceptAgain(ClientData *client, uint32_t tunnelIp, uint32_t sessionId);
+
+    uint32_t cookieTimeBucket();
+    Auth::Response getCookieMac(uint32_t realIp, const char *cookie, int length);
+    void sendCookie(ClientData *client, int dataLength); // connect data in echoReceivePayloadBuffer
+    void checkCookieResponse(ClientData *client, int dataLength);
+
+    int writeTicket(ClientData *client, char *buffer);
+    void checkResume(ClientData *client, int dataLength);
     void sendReset(ClientData *client);
+    bool redirectClient(ClientData *client);
+    void refuseClient(ClientData *client);
+    void updateLoad();
+    void handleMtuProbe(ClientData *client, int dataLength);
+    void handleModeProbe(ClientData *client, int dataLength, const ClientData::EchoId &echoId);
+    void sendDelayedProbes(ClientData *client);
+
+    int clientEchoSize(ClientData *client);
+    void sendDataToClient(ClientData *client, int dataLength); // from echoSendPayloadBuffer
+    void sendFragments(ClientData *client, int dataLength, int maxLength);
+    void sendFragmentationNeeded(int dataLength, int mtu);
 
     void sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength);
+    void sendEchoToClient(ClientData *client, TunnelHeader::Type type, int dataLength,
+                          const ClientData::EchoId &echoId);
+
+    ClientData::EchoId receivedEchoId(uint32_t realIp, uint16_t echoId, uint16_t echoSeq);
+    void pollReceived(ClientData *client, uint32_t realIp, uint16_t echoId, uint16_t echoSeq,
+                      bool modeProbe = false);
+    void handleDataFromClient(ClientData *client, int dataLength);
+    void deliverReordered(ClientData *client);
+    void logAdmissionStats();
+
+    void holdPackets(ClientData *client);
+    bool holdPacket(uint32_t tunnelIp, int dataLength, ClientData *connecting); // from echoSendPayloadBuffer
+    void releaseHeldPackets(ClientData *client);
+    bool heldFor(ClientData *client, const HeldPackets &held);
+
+    void storePollId(ClientData *client, ClientData::EchoId &echoId);
+    void releasePollId(ClientData *client, const ClientData::EchoId &echoId);
+    void dropOldestPollId(ClientData *client);
+    void clearPollIds(ClientData *client);
+    ClientData::EchoId takePollId(ClientData *client);
+    void setPollTimeout(ClientData *client, int dataLength);
+    void agePollIds(ClientData *client);
+    void logPollStats(ClientData *client);
 
-    void pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq);
+    int wireSize(int dataLength);
+    bool consumeTokens(ClientData *client, int dataLength);
+    int serveClient(ClientData *client, int maxPackets = -1);
+    void servePendingPackets();
+    void updateTimeout();
+    void updateTimeout(ClientData *client);
 
     uint32_t reserveTunnelIp(uint32_t desiredIp);
+    bool tunnelIpAvailable(uint32_t desiredIp) const;
     void releaseTunnelIp(uint32_t tunnelIp);
 
+    ClientData *getClient(const TunnelHeader &header, int dataLength, uint32_t realIp);
+    bool checkSessionAuth(ClientData *client, uint8_t type, int dataLength, int replayWindow);
+    bool checkPathSequence(ClientData *client, uint8_t type);
+    bool migrateClient(ClientData *client, uint8_t type, int dataLength, uint32_t realIp);
+    void handleNewPath(ClientData *client, uint8_t type, int dataLength, uint32_t realIp,
+                       uint16_t echoId, uint16_t echoSeq);
+    Auth::Response getPathChallengeMac(uint32_t realIp, const PathChallenge &challenge);
+    bool addPath(ClientData *client, int dataLength, uint32_t realIp);
+    bool usesAddress(ClientData *client, uint32_t realIp);
+    ClientData::PathCounters &getPathCounters(ClientData *client, uint32_t realIp, uint32_t localIp);
     ClientData *getClientByTunnelIp(uint32_t ip);
     ClientData *getClientByRealIp(uint32_t ip);
 
     Auth auth;
+    Auth::Challenge cookieSecret;
+
+    Admission admission; // handshakes and unknown sources
 
     uint32_t network;
     std::set<uint32_t> usedIps;
+
+    // issue time and session id of the tickets resumed with until they
+    // expire, every accept hands out a new one
+    typedef std::set<std::pair<uint32_t, uint32_t> > TicketSet;
+    TicketSet usedTickets;
+
+    // time bucket and first mac word of the cookies answered, with the
+    // tunnel address and session id of the client they started
+    typedef std::map<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint32_t> > CookieMap;
+    CookieMap usedCookies;
     uint32_t latestAssignedIpOffset;
 
     Time pollTimeout;
 
+    int clientRate;
+    int clientBurst;
+    TokenBucket egressShaper;
+
+    Time nextClientCheck;
+
+    std::vector<uint32_t> peers; // servers new clients are redirected to
+    int nextPeer;
+    int loadThreshold;
+    int load; // percent of cpu time or queue space in use, whichever is higher
+    Time loadSampleTime;
+    Time loadSampleCpu;
+
     ClientList clientList;
     ClientIpMap clientRealIpMap;
     ClientIpMap clientTunnelIpMap;
+    DeadlineSet deadlines; // of the clients, the earliest one sets the timeout
+    std::vector<ClientData *> sessionSlots; // by last byte of the tunnel ip
+    HeldPacketMap heldPackets;
+    PathMtuMap pathMtus;
 };
 
 #endif
@@ -27,6 +27,11 @@ Time::Time(int ms)
     tv.tv_usec = (ms % 1000) * 1000;
 }
 
+uint32_t Time::getMilliseconds() const
+{
+    return (uint32_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 Time Time::operator-(const Time &other) const
 {
     Time result;
@@ -77,6 +82,14 @@ bool Time::operator>(const Time &other) const
     return tv.tv_sec != other.tv.tv_sec ? tv.tv_sec > other.tv.tv_sec : tv.tv_usec > other.tv.tv_usec;
 }
 
+Time Time::fromMicroseconds(int us)
+{
+    Time result;
+    result.tv.tv_sec = us / 1000000;
+    result.tv.tv_usec = us % 1000000;
+    return result;
+}
+
 Time Time::now()
 {
     Time result;
@@ -21,6 +21,7 @@
 #define TIME_H
 
 #include <sys/time.h>
+#include <stdint.h>
 
 class Time
 {
@@ -29,6 +30,7 @@ public:
     Time(int ms);
 
     timeval &getTimeval() { return tv; }
+    uint32_t getMilliseconds() const; // wraps around for absolute times
 
     Time operator+(const Time &other) const;
     Time operator-(const Time &other) const;
@@ -39,6 +41,7 @@ public:
     bool operator>(const Time &other) const;
 
     static Time now();
+    static Time fromMicroseconds(int us);
 
     static const Time ZERO;
 protected:
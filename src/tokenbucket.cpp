@@ -0,0 +1,83 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "tokenbucket.h"
+
+TokenBucket::TokenBucket()
+{
+    rate = 0;
+    burst = 0;
+    tokens = 0;
+}
+
+void TokenBucket::setRate(int rate, int burst)
+{
+    this->rate = rate;
+    this->burst = burst;
+
+    if (tokens > burst)
+        tokens = burst;
+}
+
+void TokenBucket::refill(const Time &now)
+{
+    if (lastRefill == Time::ZERO || now < lastRefill)
+    {
+        lastRefill = now;
+        tokens = burst;
+        return;
+    }
+
+    timeval elapsed = (now - lastRefill).getTimeval();
+    tokens += (elapsed.tv_sec + elapsed.tv_usec / 1000000.0) * rate;
+    if (tokens > burst)
+        tokens = burst;
+
+    lastRefill = now;
+}
+
+bool TokenBucket::available(const Time &now, int amount)
+{
+    if (rate == 0)
+        return true;
+
+    refill(now);
+
+    // packets larger than the bucket may go out when it is full
+    return tokens >= (amount < burst ? amount : burst);
+}
+
+bool TokenBucket::consume(const Time &now, int amount)
+{
+    if (!available(now, amount))
+        return false;
+
+    tokens -= amount;
+    return true;
+}
+
+Time TokenBucket::timeUntilAvailable(const Time &now, int amount)
+{
+    if (available(now, amount))
+        return Time::ZERO;
+
+    // never ask for more than fits into the bucket
+    double missing = (amount < burst ? amount : burst) - tokens;
+    return Time::fromMicroseconds((int)(missing * 1000000 / rate) + 1);
+}
@@ -0,0 +1,47 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include "time.h"
+
+class TokenBucket
+{
+public:
+    TokenBucket(); // unlimited
+
+    void setRate(int rate, int burst); // tokens per second, 0 for unlimited
+    int getRate() const { return rate; }
+    int getBurst() const { return burst; }
+
+    bool available(const Time &now, int amount = 1);
+    bool consume(const Time &now, int amount = 1);
+    Time timeUntilAvailable(const Time &now, int amount = 1);
+
+protected:
+    void refill(const Time &now);
+
+    int rate;
+    int burst;
+    double tokens;
+    Time lastRefill;
+};
+
+#endif
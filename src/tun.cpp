@@ -20,6 +20,7 @@
 #include "tun.h"
 #include "exception.h"
 #include "utility.h"
+#include "config.h"
 
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -30,8 +31,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sstream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
 #ifdef WIN32
 #include <w32api/windows.h>
 #endif
@@ -70,17 +76,15 @@ Tun::Tun(const string *device, int mtu)
 
     syslog(LOG_INFO, "opened tunnel device: %s", this->device.data());
 
-    std::stringstream cmdline;
-
-#ifdef WIN32
-    cmdline << "netsh interface ipv4 set subinterface \"" << this->device
-            << "\" mtu=" << mtu;
-    winsystem(cmdline.str().data());
-#else
-    cmdline << "/sbin/ifconfig " << this->device << " mtu " << mtu;
-    if (system(cmdline.str().data()) != 0)
-        syslog(LOG_ERR, "could not set tun device mtu");
+    waitWritable = false;
+    resetStats();
+#ifndef WIN32
+    // a full device must not stall the icmp side
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+        syslog(LOG_WARNING, "could not make tunnel device non-blocking: %s", strerror(errno));
 #endif
+
+    setMtu(mtu);
 }
 
 Tun::~Tun()
@@ -113,16 +117,68 @@ void Tun::setIp(uint32_t ip, uint32_t destIp)
 #endif
 }
 
+void Tun::setMtu(int mtu)
+{
+    std::stringstream cmdline;
+
+#ifdef WIN32
+    cmdline << "netsh interface ipv4 set subinterface \"" << device
+            << "\" mtu=" << mtu;
+    winsystem(cmdline.str().data());
+#else
+    cmdline << "/sbin/ifconfig " << device << " mtu " << mtu;
+    if (system(cmdline.str().data()) != 0)
+        syslog(LOG_ERR, "could not set tun device mtu");
+#endif
+}
+
 void Tun::write(const char *buffer, int length)
+{
+    // packets go out in order, behind the ones still waiting
+    if (retryQueue.empty() && transmit(buffer, length))
+        return;
+
+    if (retryQueue.size() == SEND_RETRY_QUEUE)
+    {
+        retryQueue.pop_front();
+        stats.queueDrops++;
+        syslog(LOG_DEBUG, "tun packet dropped, write queue full");
+    }
+
+    retryQueue.push_back(std::vector<char>(buffer, buffer + length));
+}
+
+void Tun::flush()
+{
+    while (!retryQueue.empty())
+    {
+        std::vector<char> &packet = retryQueue.front();
+        if (!transmit(&packet[0], packet.size()))
+            return;
+        retryQueue.pop_front();
+    }
+}
+
+bool Tun::transmit(const char *buffer, int length)
 {
     if (tun_write(fd, (char *)buffer, length) == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        {
+            waitWritable = errno != ENOBUFS;
+            return false;
+        }
+
         syslog(LOG_ERR, "error writing %d bytes to tun: %s", length, tun_last_error());
+    }
+
+    return true;
 }
 
 int Tun::read(char *buffer)
 {
     int length = tun_read(fd, buffer, mtu);
-    if (length == -1)
+    if (length == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
         syslog(LOG_ERR, "error reading from tun: %s", tun_last_error());
     return length;
 }
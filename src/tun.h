@@ -23,11 +23,18 @@
 #include "tun_dev.h"
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <stdint.h>
 
 class Tun
 {
 public:
+    struct Stats
+    {
+        int queueDrops;
+    };
+
     Tun(const std::string *device, int mtu);
     ~Tun();
 
@@ -36,14 +43,30 @@ public:
     int read(char *buffer);
     int read(char *buffer, uint32_t &sourceIp, uint32_t &destIp);
 
+    // packets the device has no room for are queued and written by flush
     void write(const char *buffer, int length);
 
+    bool backlogged() const { return !retryQueue.empty(); }
+    bool waitsForWrite() const { return !retryQueue.empty() && waitWritable; } // else retried later
+    void flush();
+
+    const Stats &getStats() const { return stats; }
+    void resetStats() { stats.queueDrops = 0; }
+
     void setIp(uint32_t ip, uint32_t destIp);
+    void setMtu(int mtu); // reads are still limited by the mtu given on creation
 protected:
+    bool transmit(const char *buffer, int length);
+
     std::string device;
 
     int mtu;
     int fd;
+
+    std::deque<std::vector<char> > retryQueue;
+    bool waitWritable;
+
+    Stats stats;
 };
 
 #endif
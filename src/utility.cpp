@@ -44,3 +44,18 @@ int Utility::rand()
     }
     return ::rand();
 }
+
+uint16_t Utility::checksum(const char *data, int length)
+{
+    uint16_t *data16 = (uint16_t *)data;
+    uint32_t sum = 0;
+
+    for (sum = 0; length > 1; length -= 2)
+        sum += *data16++;
+    if (length == 1)
+        sum += *(unsigned char *)data16;
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return ~sum;
+}
@@ -28,6 +28,7 @@ class Utility
 public:
     static std::string formatIp(uint32_t ip);
     static int rand();
+    static uint16_t checksum(const char *data, int length); // as used by ip and icmp
 };
 
 #endif
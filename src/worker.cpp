@@ -21,8 +21,10 @@
 #include "tun.h"
 #include "exception.h"
 #include "config.h"
+#include "auth.h"
 
 #include <string.h>
+#include <arpa/inet.h>
 #include <syslog.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -50,31 +52,157 @@ bool Worker::TunnelHeader::Magic::operator!=(const Magic &other) const
 }
 
 Worker::Worker(int tunnelMtu, const std::string *deviceName, bool answerEcho,
-               uid_t uid, gid_t gid)
-    : echo(tunnelMtu + sizeof(TunnelHeader)), tun(deviceName, tunnelMtu)
+               uid_t uid, gid_t gid, int socketBufferSize)
+    : echo(tunnelMtu + headerSize(), socketBufferSize), tun(deviceName, tunnelMtu)
 {
     this->tunnelMtu = tunnelMtu;
     this->answerEcho = answerEcho;
     this->uid = uid;
     this->gid = gid;
     this->privilegesDropped = false;
+    this->queueDrops = 0;
+    this->localCapabilities = CAPABILITY_EXTENDED_HEADER | CAPABILITY_ADAPTIVE_POLLING |
+                              CAPABILITY_PACING | CAPABILITY_POLL_REFRESH |
+                              CAPABILITY_STATELESS_HANDSHAKE | CAPABILITY_SESSION_ID |
+                              CAPABILITY_RESUMPTION | CAPABILITY_PATH_MTU |
+                              CAPABILITY_MULTIPATH | CAPABILITY_REDIRECT |
+                              CAPABILITY_MODE_PROBE | CAPABILITY_IDLE_POLLS;
+    this->receivedHeaderSize = LEGACY_HEADER_SIZE;
+    this->receivedLocalIp = 0;
+}
+
+void Worker::HeaderOptions::set(TunnelHeader::Flag flag, uint32_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        if (flag == 1 << i)
+        {
+            flags |= flag;
+            values[i] = value;
+            return;
+        }
+    }
+}
+
+bool Worker::HeaderOptions::get(TunnelHeader::Flag flag, uint32_t &value) const
+{
+    if ((flags & flag) == 0)
+        return false;
+
+    for (int i = 0; i < 8; i++)
+    {
+        if (flag == 1 << i)
+        {
+            value = values[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t Worker::getSessionAuth(const std::vector<char> &sessionKey, uint32_t sessionId, uint32_t timestamp,
+                                uint32_t sequence, uint8_t type, const char *payload, int length)
+{
+    // the payload is covered as well, so a recorded packet cannot carry
+    // anything else
+    std::vector<char> data(3 * sizeof(uint32_t) + 1 + length);
+    uint32_t header[3] = { htonl(sessionId), htonl(timestamp), htonl(sequence) };
+    memcpy(&data[0], header, sizeof(header));
+    data[sizeof(header)] = type;
+    if (length > 0)
+        memcpy(&data[sizeof(header) + 1], payload, length);
+
+    Auth::Response mac = Auth::getMac(sessionKey, &data[0], data.size());
+    return ntohl(mac.data[0]);
+}
+
+void Worker::writeProtocolInfo(char *buffer, int maxPolls, int redirects)
+{
+    ProtocolInfo *info = (ProtocolInfo *)buffer;
+    memset(info, 0, sizeof(ProtocolInfo));
+    info->version = PROTOCOL_VERSION;
+    info->redirects = redirects < 255 ? redirects : 255;
+    info->maxPolls = htons(maxPolls);
+    info->capabilities = htonl(localCapabilities);
+}
+
+bool Worker::readProtocolInfo(const char *buffer, int length, ProtocolInfo &info)
+{
+    if (length < (int)sizeof(ProtocolInfo))
+        return false;
+
+    memcpy(&info, buffer, sizeof(ProtocolInfo));
+    info.maxPolls = ntohs(info.maxPolls);
+    info.capabilities = ntohl(info.capabilities);
+
+    return info.version >= 2;
 }
 
 void Worker::sendEcho(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
-                      int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq)
+                      int length, uint32_t realIp, uint32_t localIp, bool reply, uint16_t id, uint16_t seq,
+                      bool extendedHeader, const HeaderOptions &options)
 {
     if (length > payloadBufferSize())
         throw Exception("packet too big");
 
-    TunnelHeader *header = (TunnelHeader *)echo.sendPayloadBuffer();
-    header->magic = magic;
-    header->type = type;
+    char *buffer = echo.sendPayloadBuffer();
+    int offset = 0;
+
+    if (extendedHeader)
+    {
+        int optionCount = 0;
+        for (int i = 0; i < 8; i++)
+            if (options.flags & (1 << i))
+                optionCount++;
+
+        if (optionCount > MAX_HEADER_OPTIONS)
+            throw Exception("too many header options");
+
+        // the header is placed right in front of the payload, so the payload
+        // does not have to be moved
+        int extendedHeaderSize = sizeof(TunnelHeader) + optionCount * sizeof(uint32_t);
+        offset = headerSize() - extendedHeaderSize;
+
+        TunnelHeader *header = (TunnelHeader *)(buffer + offset);
+        header->magic = magic;
+        header->type = type | TunnelHeader::TYPE_EXTENDED;
+        header->flags = options.flags;
+        header->reserved = 0;
+
+        uint32_t *option = (uint32_t *)(header + 1);
+        for (int i = 0; i < 8; i++)
+            if (options.flags & (1 << i))
+                *option++ = htonl(options.values[i]);
+
+        length += extendedHeaderSize;
+
+        // probes are labeled with their size on the wire, so the option
+        // space the header leaves unused is sent as padding behind them
+        if (type == TunnelHeader::TYPE_MTU_PROBE && offset != 0)
+        {
+            memmove(buffer, buffer + offset, length);
+            memset(buffer + length, 0, offset);
+            length += offset;
+            offset = 0;
+        }
+    }
+    else
+    {
+        // legacy peers need the payload right behind the short header
+        memmove(buffer + LEGACY_HEADER_SIZE, echoSendPayloadBuffer(), length);
+
+        TunnelHeader *header = (TunnelHeader *)buffer;
+        header->magic = magic;
+        header->type = type;
+
+        length += LEGACY_HEADER_SIZE;
+    }
 
     DEBUG_ONLY(
         cout << "sending: type " << type << ", length " << length
              << ", id " << id << ", seq " << seq << endl);
 
-    echo.send(length + sizeof(TunnelHeader), realIp, reply, id, seq);
+    echo.send(length, realIp, reply, id, seq, offset, localIp);
 }
 
 void Worker::sendToTun(int length)
@@ -96,12 +224,22 @@ void Worker::run()
 
     while (alive)
     {
-        fd_set fs;
+        fd_set fs, writeFs;
         Time timeout;
 
+        // while one side cannot take more, reading the other would only
+        // grow its queue, the kernel buffers hold the packets meanwhile
         FD_ZERO(&fs);
-        FD_SET(tun.getFd(), &fs);
-        FD_SET(echo.getFd(), &fs);
+        if (!echo.backlogged())
+            FD_SET(tun.getFd(), &fs);
+        if (!tun.backlogged())
+            FD_SET(echo.getFd(), &fs);
+
+        FD_ZERO(&writeFs);
+        if (echo.waitsForWrite())
+            FD_SET(echo.getFd(), &writeFs);
+        if (tun.waitsForWrite())
+            FD_SET(tun.getFd(), &writeFs);
 
         if (nextTimeout != Time::ZERO)
         {
@@ -110,9 +248,16 @@ void Worker::run()
                 timeout = Time::ZERO;
         }
 
+        // a full device queue does not make the descriptor writable again
+        bool retry = (echo.backlogged() && !echo.waitsForWrite()) ||
+                     (tun.backlogged() && !tun.waitsForWrite());
+        bool retryTimeout = retry && (nextTimeout == Time::ZERO || timeout > Time(SEND_RETRY_INTERVAL));
+        if (retryTimeout)
+            timeout = Time(SEND_RETRY_INTERVAL);
+
         // wait for data or timeout
-        timeval *timeval = nextTimeout != Time::ZERO ? &timeout.getTimeval() : NULL;
-        int result = select(maxFd + 1 , &fs, NULL, NULL, timeval);
+        timeval *timeval = nextTimeout != Time::ZERO || retryTimeout ? &timeout.getTimeval() : NULL;
+        int result = select(maxFd + 1 , &fs, &writeFs, NULL, timeval);
         if (result == -1)
         {
             if (alive)
@@ -122,8 +267,17 @@ void Worker::run()
         }
         now = Time::now();
 
+        if (echo.backlogged())
+            echo.flush();
+        if (tun.backlogged())
+            tun.flush();
+
+        // checked before the timeout, on a quiet link the loop ends there
+        if (nextDropStats < now)
+            logDropStats();
+
         // timeout
-        if (result == 0)
+        if (result == 0 && !retryTimeout)
         {
             nextTimeout = Time::ZERO;
             handleTimeout();
@@ -137,27 +291,67 @@ void Worker::run()
             uint16_t id, seq;
             uint32_t ip;
 
-            int dataLength = echo.receive(ip, reply, id, seq);
-            if (dataLength != -1)
+            int dataLength = echo.receive(ip, reply, id, seq, receivedLocalIp, receivedTime);
+
+            // now is taken once for all the echoes read after a select
+            if (receivedTime == Time::ZERO || now < receivedTime)
+                receivedTime = now;
+            if (dataLength == -1)
             {
-                bool valid = dataLength >= sizeof(TunnelHeader);
+                // echoes we sent that did not make it
+                int mtu;
+                while (echo.receiveError(ip, mtu))
+                    if (mtu != 0)
+                        handlePacketTooBig(ip, mtu);
+            }
+            else
+            {
+                TunnelHeader header;
+                bool valid = dataLength >= LEGACY_HEADER_SIZE;
+                int padding = 0;
 
                 if (valid)
                 {
-                    TunnelHeader *header = (TunnelHeader *)echo.receivePayloadBuffer();
+                    const TunnelHeader *received = (const TunnelHeader *)echo.receivePayloadBuffer();
+                    header.magic = received->magic;
+                    header.type = received->type;
+
+                    if (header.type & TunnelHeader::TYPE_EXTENDED)
+                    {
+                        header.type &= ~TunnelHeader::TYPE_EXTENDED;
+                        valid = readHeaderOptions(received, dataLength);
+                        header.flags = receivedOptions.flags;
+                        header.reserved = 0;
+
+                        if (header.type == TunnelHeader::TYPE_MTU_PROBE)
+                        {
+                            padding = headerSize() - receivedHeaderSize;
+                            valid = valid && dataLength - receivedHeaderSize >= padding;
+                        }
+                    }
+                    else
+                    {
+                        header.flags = 0;
+                        header.reserved = 0;
+                        receivedOptions.flags = 0;
+                        receivedHeaderSize = LEGACY_HEADER_SIZE;
+                    }
+                }
 
+                if (valid)
+                {
                     DEBUG_ONLY(
-                        cout << "received: type " << header->type
-                             << ", length " << dataLength - sizeof(TunnelHeader)
+                        cout << "received: type " << (int)header.type
+                             << ", length " << dataLength - receivedHeaderSize - padding
                              << ", id " << id << ", seq " << seq << endl);
 
-                    valid = handleEchoData(*header, dataLength - sizeof(TunnelHeader), ip, reply, id, seq);
+                    valid = handleEchoData(header, dataLength - receivedHeaderSize - padding, ip, reply, id, seq);
                 }
 
                 if (!valid && !reply && answerEcho)
                 {
                     memcpy(echo.sendPayloadBuffer(), echo.receivePayloadBuffer(), dataLength);
-                    echo.send(dataLength, ip, true, id, seq);
+                    echo.send(dataLength, ip, true, id, seq, 0, receivedLocalIp);
                 }
             }
         }
@@ -175,14 +369,62 @@ void Worker::run()
             if (dataLength != -1)
                 handleTunData(dataLength, sourceIp, destIp);
         }
+
+        // timeouts have to fire while data keeps arriving as well
+        if (nextTimeout != Time::ZERO && !(now < nextTimeout))
+        {
+            nextTimeout = Time::ZERO;
+            handleTimeout();
+        }
     }
 }
 
+bool Worker::readHeaderOptions(const TunnelHeader *header, int dataLength)
+{
+    receivedOptions.flags = 0;
+    receivedHeaderSize = sizeof(TunnelHeader);
+
+    if (dataLength < receivedHeaderSize)
+        return false;
+
+    const uint32_t *option = (const uint32_t *)(header + 1);
+    for (int i = 0; i < 8; i++)
+    {
+        if ((header->flags & (1 << i)) == 0)
+            continue;
+
+        receivedHeaderSize += sizeof(uint32_t);
+        if (dataLength < receivedHeaderSize)
+            return false;
+
+        receivedOptions.flags |= 1 << i;
+        receivedOptions.values[i] = ntohl(*option++);
+    }
+
+    return true;
+}
+
 void Worker::stop()
 {
     alive = false;
 }
 
+void Worker::logDropStats()
+{
+    // losses on the wire show in the echo loss the client measures
+    const Echo::Stats &echoStats = echo.getStats();
+    int ownDrops = queueDrops + echoStats.queueDrops + tun.getStats().queueDrops;
+
+    if (echoStats.kernelDrops != 0 || ownDrops != 0)
+        syslog(LOG_INFO, "drops: %d echoes in the kernel receive queue, %d packets in our queues",
+               echoStats.kernelDrops, ownDrops);
+
+    echo.resetStats();
+    tun.resetStats();
+    queueDrops = 0;
+    nextDropStats = now + DROP_STATS_INTERVAL;
+}
+
 void Worker::dropPrivileges()
 {
     if (uid <= 0 || privilegesDropped)
@@ -215,12 +457,14 @@ void Worker::handleTunData(int, uint32_t, uint32_t) { }
 
 void Worker::handleTimeout() { }
 
+void Worker::handlePacketTooBig(uint32_t, int) { }
+
 char *Worker::echoSendPayloadBuffer()
 {
-    return echo.sendPayloadBuffer() + sizeof(TunnelHeader);
+    return echo.sendPayloadBuffer() + headerSize();
 }
 
 char *Worker::echoReceivePayloadBuffer()
 {
-    return echo.receivePayloadBuffer() + sizeof(TunnelHeader);
+    return echo.receivePayloadBuffer() + receivedHeaderSize;
 }
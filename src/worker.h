@@ -25,19 +25,20 @@
 #include "tun.h"
 
 #include <string>
+#include <vector>
 #include <sys/types.h>
 
 class Worker
 {
 public:
     Worker(int tunnelMtu, const std::string *deviceName, bool answerEcho,
-           uid_t uid, gid_t gid);
+           uid_t uid, gid_t gid, int socketBufferSize);
     virtual ~Worker() { }
 
     virtual void run();
     virtual void stop();
 
-    static int headerSize() { return sizeof(TunnelHeader); }
+    static int headerSize() { return sizeof(TunnelHeader) + MAX_HEADER_OPTIONS * sizeof(uint32_t); }
 
 protected:
     struct TunnelHeader
@@ -63,21 +64,151 @@ protected:
             TYPE_CHALLENGE_ERROR = 6,
             TYPE_DATA = 7,
             TYPE_POLL = 8,
-            TYPE_SERVER_FULL = 9
+            TYPE_SERVER_FULL = 9,
+            TYPE_CHALLENGE_COOKIE = 10, // returned along with the response
+            TYPE_RESUME = 11, // ticket from an earlier accept, replaces the handshake
+            TYPE_MTU_PROBE = 12, // padded to the echo size it probes, see MtuProbe
+            TYPE_REDIRECT = 13, // addresses of other servers to connect to instead
+            TYPE_MODE_PROBE = 14, // tells what the path lets through, see ModeProbe
+            TYPE_PATH_CHALLENGE = 15 // a new address proves it is the client's, see PathChallenge
+        };
+
+        // set in the type field if flags and reserved are present
+        static const uint8_t TYPE_EXTENDED = 0x80;
+
+        // each set flag is followed by a 32 bit option word, in bit order
+        enum Flag
+        {
+            FLAG_TIMESTAMP = 1 << 0, // client time in ms, echoed by the server
+            FLAG_POLL_STATUS = 1 << 1, // server: pending packets << 16 | stored polls
+            FLAG_POLL_WINDOW = 1 << 2, // client: polls the server should keep
+            FLAG_COUNTERS = 1 << 3, // server: requests received << 16 | replies sent
+            FLAG_SESSION = 1 << 4, // client: session id assigned by the server
+            FLAG_SESSION_AUTH = 1 << 5, // client: mac of session id, timestamp, sequence, type and payload
+            FLAG_SEQUENCE = 1 << 6, // sequence number of data, or of other requests, on a multipath session
+            FLAG_PATH_COUNTERS = 1 << 7 // server: like FLAG_COUNTERS, for the path of the reply
         };
 
         Magic magic;
         uint8_t type;
-    }; // size = 5
+
+        // the fields below are only sent to peers that negotiated
+        // CAPABILITY_EXTENDED_HEADER, they align the payload to 4 bytes
+        uint8_t flags;
+        uint16_t reserved;
+    }; // size = 8, legacy size = 5
+
+    enum
+    {
+        LEGACY_HEADER_SIZE = 5,
+        MAX_HEADER_OPTIONS = 5
+    };
+
+public:
+    // a payload waiting to be sent, used by the queues of both sides
+    struct Packet
+    {
+        TunnelHeader::Type type;
+        std::vector<char> data;
+    };
+
+protected:
+    struct HeaderOptions
+    {
+        HeaderOptions() : flags(0) { }
+
+        void set(TunnelHeader::Flag flag, uint32_t value);
+        bool get(TunnelHeader::Flag flag, uint32_t &value) const;
+
+        uint8_t flags;
+        uint32_t values[8];
+    };
+
+    enum Capability
+    {
+        CAPABILITY_EXTENDED_HEADER = 1 << 0,
+        CAPABILITY_ADAPTIVE_POLLING = 1 << 1,
+        CAPABILITY_PACING = 1 << 2,
+        CAPABILITY_POLL_REFRESH = 1 << 3, // empty poll replies replace stale ids
+        CAPABILITY_STATELESS_HANDSHAKE = 1 << 4,
+        CAPABILITY_SESSION_ID = 1 << 5, // accept carries a session id, sent in every request
+        CAPABILITY_RESUMPTION = 1 << 6, // accept carries a resumption ticket after the session id
+        CAPABILITY_PATH_MTU = 1 << 7, // mtu probes are answered at the probed size
+        CAPABILITY_MULTIPATH = 1 << 8, // a session may use several addresses, data is reordered
+        CAPABILITY_REDIRECT = 1 << 9, // full or busy servers name others instead of refusing
+        CAPABILITY_MODE_PROBE = 1 << 10, // mode probes are answered, a poll window of 0 stops polling
+        CAPABILITY_IDLE_POLLS = 1 << 11 // polls may carry how long to hold them, up to IDLE_MAX_KEEPALIVE
+    };
+
+    // appended to connection requests, accepts and resets by peers
+    // speaking protocol version 2 or later
+    struct ProtocolInfo
+    {
+        uint8_t version;
+        uint8_t redirects; // followed by the client before this connection request
+        uint16_t maxPolls; // requested by the client, granted by the server
+        uint32_t capabilities;
+    }; // size = 8, network byte order
+
+    // payload of TYPE_MTU_PROBE, requests and replies are padded with zeros
+    // to the probed size
+    struct MtuProbe
+    {
+        enum Kind
+        {
+            KIND_REQUEST = 1,
+            KIND_REPLY = 2,
+            KIND_RESULT = 3 // the client reports the echo size it uses
+        };
+
+        uint16_t size; // of the whole echo packet, including the ip header
+        uint8_t kind;
+        uint8_t reserved;
+    }; // size = 4, network byte order
+
+    // payload of TYPE_MODE_PROBE, the server answers a request with the
+    // given number of replies right away and one more after the delay
+    struct ModeProbe
+    {
+        enum Kind
+        {
+            KIND_REQUEST = 1,
+            KIND_REPLY = 2
+        };
+
+        uint8_t kind;
+        uint8_t replies; // request: replies wanted now, reply: index, the delayed one last
+        uint16_t delay; // ms, 0 for no delayed reply
+        uint32_t token; // chosen by the client, returned in the replies
+    }; // size = 8, network byte order
+
+    // payload of TYPE_PATH_CHALLENGE. the server sends it to a new address
+    // of a multipath session, the client returns it from there followed by
+    // its mac under the session key
+    struct PathChallenge
+    {
+        uint32_t timeBucket;
+        uint32_t sessionId;
+        uint32_t mac[5]; // of the server, also covers the address it went to
+    }; // size = 28, network byte order
+
+    static uint32_t getSessionAuth(const std::vector<char> &sessionKey, uint32_t sessionId, uint32_t timestamp,
+                                   uint32_t sequence, uint8_t type, const char *payload, int length);
+
+    void writeProtocolInfo(char *buffer, int maxPolls, int redirects = 0);
+    static bool readProtocolInfo(const char *buffer, int length, ProtocolInfo &info);
 
     virtual bool handleEchoData(const TunnelHeader &header, int dataLength,
                                 uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
     virtual void handleTunData(int dataLength, uint32_t sourceIp,
                                uint32_t destIp); // to echoSendPayloadBuffer
     virtual void handleTimeout();
+    virtual void handlePacketTooBig(uint32_t realIp, int mtu);
 
     void sendEcho(const TunnelHeader::Magic &magic, TunnelHeader::Type type,
-                  int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq);
+                  int length, uint32_t realIp, uint32_t localIp, bool reply, uint16_t id, uint16_t seq,
+                  bool extendedHeader = false,
+                  const HeaderOptions &options = HeaderOptions());
     void sendToTun(int length); // from echoReceivePayloadBuffer
 
     void setTimeout(Time delta);
@@ -86,9 +217,13 @@ protected:
     char *echoReceivePayloadBuffer();
 
     int payloadBufferSize() { return tunnelMtu; }
+    int maxEchoSize() { return tunnelMtu + headerSize() + Echo::headerSize(); }
+    static int mtuProbeLength(int echoSize) { return echoSize - headerSize() - Echo::headerSize(); }
 
     void dropPrivileges();
 
+    void logDropStats();
+
     Echo echo;
     Tun tun;
     bool alive;
@@ -100,11 +235,23 @@ protected:
 
     bool privilegesDropped;
 
+    uint32_t localCapabilities;
+
+    int queueDrops; // packets our own queues had no room for
+
+    HeaderOptions receivedOptions;
+    uint32_t receivedLocalIp; // address the current echo was sent to, 0 if unknown
+    Time receivedTime; // when the kernel got the current echo, for measurements
+
     Time now;
 private:
     int readIcmpData(int *realIp, int *id, int *seq);
+    bool readHeaderOptions(const TunnelHeader *header, int dataLength);
+
+    int receivedHeaderSize;
 
     Time nextTimeout;
+    Time nextDropStats;
 };
 
 #endif